@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <string.h>
+#include "gc.h"
+#include "arena.h"
+
+/*
+   Compile time objects (AST nodes, type relations, scratch arrays)
+   are bumped out of a chain of large chunks instead of being
+   allocated one at a time. Everything allocated since the last
+   promotion is thrown away at once by arena_reset after each
+   top level statement, and the chunks are reused for the next one.
+*/
+
+arena_chunk_t * arena_first; /* first chunk in the chain */
+arena_chunk_t * arena_cur; /* chunk we are currently allocating from */
+size_t arena_pos; /* next free byte in the current chunk */
+
+arena_chunk_t * arena_base; /* everything before here has been promoted */
+size_t arena_base_pos;
+
+long arena_allocs = 0; /* statistics for the stats command */
+long arena_bytes = 0;
+long arena_resets = 0;
+long arena_promotions = 0;
+long arena_chunks = 0;
+long arena_chunk_bytes = 0;
+
+arena_chunk_t * arena_new_chunk(size_t size)
+{
+   arena_chunk_t * c;
+
+   if (size < ARENA_CHUNK_SIZE)
+      size = ARENA_CHUNK_SIZE;
+
+   c = (arena_chunk_t *) GC_MALLOC(sizeof(arena_chunk_t) + size);
+   c->size = size;
+
+   arena_chunks++;
+   arena_chunk_bytes += size;
+
+   return c;
+}
+
+void arena_init(void)
+{
+   arena_first = arena_new_chunk(ARENA_CHUNK_SIZE);
+   arena_cur = arena_first;
+   arena_pos = 0;
+   arena_base = arena_first;
+   arena_base_pos = 0;
+}
+
+/*
+   Return size bytes of zeroed memory that lives until the next
+   arena_reset, unless it is promoted first
+*/
+void * arena_alloc(size_t size)
+{
+   void * p;
+
+   size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+
+   if (arena_pos + size > arena_cur->size)
+   {
+      /* reuse the next chunk if it is large enough, else link in a new one */
+      if (arena_cur->next == NULL || arena_cur->next->size < size)
+      {
+         arena_chunk_t * c = arena_new_chunk(size);
+         c->next = arena_cur->next;
+         arena_cur->next = c;
+      }
+
+      arena_cur = arena_cur->next;
+      arena_pos = 0;
+   }
+
+   p = arena_cur->data + arena_pos;
+   arena_pos += size;
+   memset(p, 0, size);
+
+   arena_allocs++;
+   arena_bytes += size;
+
+   return p;
+}
+
+/*
+   Throw away everything allocated since the last promotion,
+   keeping the chunks for reuse
+*/
+void arena_reset(void)
+{
+   arena_cur = arena_base;
+   arena_pos = arena_base_pos;
+   arena_resets++;
+}
+
+/*
+   Keep everything allocated so far, e.g. the AST of a function
+   that is bound in the global scope and jit'd when first called.
+   Promoted memory is never reclaimed, not even once the function is
+   redefined and its module removed: the arena can only be reset back
+   to the last promotion, so each definition costs its AST for the
+   rest of the session.
+*/
+void arena_promote(void)
+{
+   arena_base = arena_cur;
+   arena_base_pos = arena_pos;
+   arena_promotions++;
+}
+
+void print_arena_stats(void)
+{
+   printf("arena: %ld allocations, %ld bytes, %ld resets, %ld promotions, %ld chunks (%ld bytes)\n",
+           arena_allocs, arena_bytes, arena_resets, arena_promotions,
+           arena_chunks, arena_chunk_bytes);
+}
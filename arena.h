@@ -0,0 +1,35 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#include <stddef.h>
+
+#define ARENA_CHUNK_SIZE 65536 /* bytes per arena chunk */
+
+#define ARENA_ALIGN 8 /* alignment of every arena allocation */
+
+/* A block of arena memory, objects are bumped out of data */
+typedef struct arena_chunk_t {
+   struct arena_chunk_t * next;
+   size_t size; /* usable bytes in data */
+   char data[1];
+} arena_chunk_t;
+
+void arena_init(void);
+
+void * arena_alloc(size_t size);
+
+void arena_reset(void);
+
+void arena_promote(void);
+
+void print_arena_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,10 +1,25 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "gc.h"
+#include "arena.h"
 #include "types.h"
 #include "ast.h"
 
 ast_t * root;
+int syntax_error = 0; /* the last statement failed to parse */
+
+LLVMValueRef * ast_val;
+bind_t ** ast_bind;
+env_t ** ast_env;
+
+int ast_side_len = 0; /* allocated length of the side tables */
+int ast_count = 0; /* ids handed out so far */
+int ast_kept = 0; /* ids of nodes that have been promoted */
+int ast_max = 0; /* most ids in use at once */
+
+walk_t * walk_stack;
+int walk_len = 0;
+int walk_alloc = 0;
 
 ast_t * op_plus;
 ast_t * op_minus;
@@ -67,9 +82,79 @@ void ast_init(void)
     op_rsheq = ast_op(AST_RSHEQ);
 }
 
+/*
+   Double the length of the side tables
+*/
+void ast_side_grow(void)
+{
+   int len = ast_side_len == 0 ? AST_SIDE_INIT : 2*ast_side_len;
+
+   ast_val = (LLVMValueRef *) GC_REALLOC(ast_val, len*sizeof(LLVMValueRef));
+   ast_bind = (bind_t **) GC_REALLOC(ast_bind, len*sizeof(bind_t *));
+   ast_env = (env_t **) GC_REALLOC(ast_env, len*sizeof(env_t *));
+
+   ast_side_len = len;
+}
+
 ast_t * new_ast(void)
 {
-   return (ast_t *) GC_MALLOC(sizeof(ast_t));
+   ast_t * ast = (ast_t *) arena_alloc(sizeof(ast_t));
+
+   if (ast_count == ast_side_len)
+      ast_side_grow();
+
+   ast->id = ast_count++;
+   if (ast_count > ast_max)
+      ast_max = ast_count;
+
+   ast_val[ast->id] = NULL;
+   ast_bind[ast->id] = NULL;
+   ast_env[ast->id] = NULL;
+
+   return ast;
+}
+
+/*
+   Keep the ids of all nodes made so far, along with the nodes
+   themselves (see arena_promote). Like the nodes, the ids are never
+   handed out again.
+*/
+void ast_promote(void)
+{
+   ast_kept = ast_count;
+}
+
+/*
+   Hand out the ids of nodes made since the last promotion again
+*/
+void ast_reset(void)
+{
+   ast_count = ast_kept;
+}
+
+/*
+   Push a node to be visited onto the walk stack. A walker records
+   walk_len when it starts and pops until it is back to that depth, 
+   so walks can be nested
+*/
+void walk_push(ast_t * ast, walk_op_t op)
+{
+   if (walk_len == walk_alloc)
+   {
+      walk_alloc = walk_alloc == 0 ? 256 : 2*walk_alloc;
+      walk_stack = (walk_t *) GC_REALLOC(walk_stack, walk_alloc*sizeof(walk_t));
+   }
+
+   walk_stack[walk_len].ast = ast;
+   walk_stack[walk_len].op = op;
+   walk_len++;
+}
+
+void print_ast_stats(void)
+{
+   printf("ast: %d nodes kept, %d most in use, %d bytes per node + %d in side tables\n",
+          ast_kept, ast_max, (int) sizeof(ast_t), 
+          (int) (sizeof(LLVMValueRef) + sizeof(bind_t *) + sizeof(env_t *)));
 }
 
 ast_t * ast_symbol(sym_t * sym, tag_t tag)
@@ -80,6 +165,74 @@ ast_t * ast_symbol(sym_t * sym, tag_t tag)
    return ast;
 }
 
+/*
+   Literals are converted once, at parse time
+*/
+ast_t * ast_int(const char * text)
+{
+   ast_t * ast = new_ast();
+   ast->tag = AST_INT;
+   ast->ival = atol(text);
+   return ast;
+}
+
+ast_t * ast_double(const char * text)
+{
+   ast_t * ast = new_ast();
+   ast->tag = AST_DOUBLE;
+   ast->dval = atof(text);
+   return ast;
+}
+
+ast_t * ast_bool(int b)
+{
+   ast_t * ast = new_ast();
+   ast->tag = AST_BOOL;
+   ast->ival = b;
+   return ast;
+}
+
+/*
+   Strip the quotes from a string literal and replace escape 
+   sequences with the characters they stand for
+*/
+ast_t * ast_string(const char * text, int length)
+{
+   ast_t * ast = new_ast();
+   char * str = (char *) arena_alloc(length);
+   int i, j = 0;
+
+   for (i = 1; i < length - 1; i++, j++)
+   {
+      if (text[i] == '\\' && i < length - 2)
+      {
+         i++;
+         switch (text[i])
+         {
+         case '0':
+            str[j] = '\0';
+            break;
+         case 'n':
+            str[j] = '\n';
+            break;
+         case 'r':
+            str[j] = '\r';
+            break;
+         case 't':
+            str[j] = '\t';
+            break;
+         default: /* includes \\ and \" */
+            str[j] = text[i];
+         }
+      } else
+         str[j] = text[i];
+   }
+
+   ast->tag = AST_STRING;
+   ast->str = lit_lookup(str, j);
+   return ast;
+}
+
 ast_t * ast_unary(ast_t * a, tag_t tag)
 {
    ast_t * ast = new_ast();
@@ -97,6 +250,57 @@ ast_t * ast_binary(ast_t * a1, ast_t * a2, ast_t * op)
    return ast;
 }
 
+/*
+   Binding strength of each binary operator, indexed by tag - AST_PLUS.
+   Higher binds tighter, all operators are left associative.
+*/
+static const int ast_prec[] = {
+   9, 9, 10, 10, 10, /* + - * / % */
+   8, 8,             /* << >> */
+   3, 5, 4,          /* | & ^| */
+   7, 7, 7, 7,       /* <= >= < > */
+   6, 6,             /* == != */
+   2, 1              /* && || */
+};
+
+#define AST_PREC(a) ((a) == NULL ? 0 : ast_prec[(a)->tag - AST_PLUS])
+
+/*
+   Fold the operators at the front of *ops which bind at least as tightly
+   as min into lhs. Each operator node has its right operand as child.
+*/
+ast_t * ast_climb(ast_t * lhs, ast_t ** ops, int min)
+{
+   while (AST_PREC(*ops) >= min)
+   {
+      ast_t * op = *ops;
+      ast_t * rhs = op->child;
+      int prec = AST_PREC(op);
+      
+      *ops = op->next;
+      while (AST_PREC(*ops) > prec)
+         rhs = ast_climb(rhs, ops, prec + 1);
+
+      lhs = ast_binary(lhs, rhs, op);
+   }
+
+   return lhs;
+}
+
+/*
+   Build the tree for an infix expression from a list consisting of 
+   its first operand followed by an operator node for each further 
+   operand, as parsed by the Infix rule
+*/
+ast_t * ast_infix(ast_t * a)
+{
+   ast_t * ops = a->next;
+   
+   a->next = NULL;
+   
+   return ast_climb(a, &ops, 1);
+}
+
 ast_t * ast_op(tag_t tag)
 {
    ast_t * ast = new_ast();
@@ -307,22 +511,22 @@ void ast_print(ast_t * a, int indent)
         printf("\n");
         break;
     case AST_INT:
-        printf("int(%s)", a->sym->name);
+        printf("int(%ld)", a->ival);
         ast_print_type(a);
         printf("\n");
         break;
     case AST_DOUBLE:
-        printf("double(%s)", a->sym->name);
+        printf("double(%g)", a->dval);
         ast_print_type(a);
         printf("\n");
         break;
     case AST_STRING:
-        printf("string(%s)", a->sym->name);
+        printf("string(\"%s\")", a->str->str);
         ast_print_type(a);
         printf("\n");
         break;
     case AST_BOOL:
-        printf("bool(%s)", a->sym->name);
+        printf("bool(%s)", a->ival ? "true" : "false");
         ast_print_type(a);
         printf("\n");
         break;
@@ -3,7 +3,6 @@
 
 #include <llvm-c/Core.h>  
 #include <llvm-c/Analysis.h>  
-#include <llvm-c/ExecutionEngine.h>  
 #include <llvm-c/Target.h>  
 #include <llvm-c/Transforms/Scalar.h> 
 
@@ -41,20 +40,56 @@ typedef enum {
    AST_NIL
 } tag_t;
 
+#define AST_SIDE_INIT 1024 /* initial length of the side tables */
+
+/* 
+   The node itself holds only what every pass walks over, data used
+   by particular passes is kept in the side tables below, indexed by
+   the node id
+*/
 typedef struct ast_t {
    struct ast_t * next;
    struct ast_t * child;
    tag_t tag;
-   sym_t * sym;
+   int id;
+   union {
+      sym_t * sym;
+      long ival; /* AST_INT, AST_BOOL */
+      double dval; /* AST_DOUBLE */
+      lit_t * str; /* AST_STRING */
+   };
    type_t * type;
-   struct bind_t * bind;
-   struct env_t * env;
-   LLVMValueRef val;
-   struct bind_t ** bind_arr;
-   int bind_num;
 } ast_t;
 
+extern LLVMValueRef * ast_val; /* value jit'd for the node */
+extern struct bind_t ** ast_bind; /* binding an identifier resolved to */
+extern struct env_t ** ast_env; /* scope opened by a block, function etc. */
+
+#define AST_VAL(a) (ast_val[(a)->id])
+#define AST_BIND(a) (ast_bind[(a)->id])
+#define AST_ENV(a) (ast_env[(a)->id])
+
+/* 
+   Passes that walk the whole AST keep the nodes still to visit on 
+   an explicit stack, so long statement lists don't recurse on the 
+   C stack
+*/
+typedef enum {
+   WALK_LIST, /* visit a node and the nodes following it */
+   WALK_NODE, /* visit a node but not the nodes following it */
+   WALK_SCOPE_DOWN /* leave the scope of a node we visited */
+} walk_op_t;
+
+typedef struct walk_t {
+   ast_t * ast;
+   walk_op_t op;
+} walk_t;
+
+extern walk_t * walk_stack;
+extern int walk_len;
+
 extern ast_t * root;
+extern int syntax_error;
 
 extern ast_t * op_plus;
 extern ast_t * op_minus;
@@ -91,8 +126,24 @@ void ast_init(void);
 
 ast_t * new_ast(void);
 
+void ast_promote(void);
+
+void ast_reset(void);
+
+void print_ast_stats(void);
+
+void walk_push(ast_t * ast, walk_op_t op);
+
 ast_t * ast_symbol(sym_t * sym, tag_t tag);
 
+ast_t * ast_int(const char * text);
+
+ast_t * ast_double(const char * text);
+
+ast_t * ast_bool(int b);
+
+ast_t * ast_string(const char * text, int length);
+
 ast_t * ast_unary(ast_t * a, tag_t tag);
 
 ast_t * ast_binary(ast_t * a1, ast_t * a2, ast_t * op);
@@ -103,6 +154,8 @@ ast_t * ast_stmt2(ast_t * a1, ast_t * a2, tag_t tag);
 
 ast_t * ast_stmt3(ast_t * a1, ast_t * a2, ast_t * a3, tag_t tag);
 
+ast_t * ast_infix(ast_t * a);
+
 ast_t * ast_op(tag_t tag);
 
 ast_t * ast_reverse(ast_t * a);
@@ -10,21 +10,37 @@
 #include "unify.h"
 #include "ast.h"
 #include "gc.h"
+#include "arena.h"
+#include "cache.h"
 
 #include <llvm-c/Core.h>  
 #include <llvm-c/Analysis.h>  
-#include <llvm-c/ExecutionEngine.h>  
+#include <llvm-c/LLJIT.h>  
+#include <llvm-c/Linker.h>  
+#include <llvm-c/Object.h>  
 #include <llvm-c/Target.h>  
-#include <llvm-c/Transforms/Scalar.h> 
+#include <llvm-c/TargetMachine.h>  
+#include <llvm-c/Transforms/PassBuilder.h> 
+#include <llvm/Config/llvm-config.h>
+#include <llvm/MC/MCSubtargetInfo.h>
+#include <llvm/MC/TargetRegistry.h>
 
 #ifndef CS_MALLOC_NAME /* make it easy to turn off GC */
 #define CS_MALLOC_NAME "GC_malloc"
 #define CS_MALLOC_NAME2 "GC_malloc_atomic"
+#define CS_INIT_NAME "GC_init"
 #endif
 
+/* Make the enum attribute with the given name, e.g. "noalias" */
+LLVMAttributeRef llvm_attr(const char * name)
+{
+   unsigned kind = LLVMGetEnumAttributeKindForName(name, strlen(name));
+   return LLVMCreateEnumAttribute(LLVMGetGlobalContext(), kind, 0);
+}
+
 /* 
    Tell LLVM about some external library functions so we can call them 
-   and about some constants we want to use from jit'd code
+   from the module we are jit'ing into
 */
 void llvm_functions(jit_t * jit)
 {
@@ -50,14 +66,20 @@ void llvm_functions(jit_t * jit)
    ret = LLVMPointerType(LLVMInt8Type(), 0);
    fntype = LLVMFunctionType(ret, args, 1, 0);
    fn = LLVMAddFunction(jit->module, CS_MALLOC_NAME, fntype);
-   LLVMAddFunctionAttr(fn, LLVMNoAliasAttribute);
+   LLVMAddAttributeAtIndex(fn, LLVMAttributeReturnIndex, llvm_attr("noalias"));
 
    /* patch in the GC_malloc_atomic function */
    args[0] = LLVMWordType();
    ret = LLVMPointerType(LLVMInt8Type(), 0);
    fntype = LLVMFunctionType(ret, args, 1, 0);
    fn = LLVMAddFunction(jit->module, CS_MALLOC_NAME2, fntype);
-   LLVMAddFunctionAttr(fn, LLVMNoAliasAttribute);
+   LLVMAddAttributeAtIndex(fn, LLVMAttributeReturnIndex, llvm_attr("noalias"));
+
+   /* patch in llvm_tier_up, which tier 0 functions call once hot */
+   args[0] = LLVMPointerType(LLVMInt8Type(), 0);
+   ret = LLVMVoidType();
+   fntype = LLVMFunctionType(ret, args, 1, 0);
+   fn = LLVMAddFunction(jit->module, "llvm_tier_up", fntype);
 }
 
 /* count parameters as represented by %'s in format string */
@@ -91,16 +113,19 @@ void llvm_printf(jit_t * jit, const char * fmt, ...)
    LLVMValueRef fn = LLVMGetNamedFunction(jit->module, "printf");
    LLVMSetFunctionCallConv(fn, LLVMCCallConv);
    
-   /* Add a global variable for format string */
+   /* 
+      Add a global variable for format string, it goes away with the
+      module. It has no name, so it can't clash with an exported one.
+   */
    LLVMValueRef str = LLVMConstString(fmt, strlen(fmt), 0);
-   jit->fmt_str = LLVMAddGlobal(jit->module, LLVMTypeOf(str), "fmt");
-   LLVMSetInitializer(jit->fmt_str, str);
-   LLVMSetGlobalConstant(jit->fmt_str, 1);
-   LLVMSetLinkage(jit->fmt_str, LLVMInternalLinkage);
+   LLVMValueRef fmt_str = LLVMAddGlobal(jit->module, LLVMTypeOf(str), "");
+   LLVMSetInitializer(fmt_str, str);
+   LLVMSetGlobalConstant(fmt_str, 1);
+   LLVMSetLinkage(fmt_str, LLVMPrivateLinkage);
    
    /* build variadic parameter list for printf */
    LLVMValueRef indices[2] = { LLVMConstInt(LLVMWordType(), 0, 0), LLVMConstInt(LLVMWordType(), 0, 0) };
-   LLVMValueRef GEP = LLVMBuildGEP(jit->builder, jit->fmt_str, indices, 2, "str");
+   LLVMValueRef GEP = LLVMBuildGEP(jit->builder, fmt_str, indices, 2, "str");
    LLVMValueRef args[count + 1];
    args[0] = GEP;
    
@@ -114,8 +139,8 @@ void llvm_printf(jit_t * jit, const char * fmt, ...)
    /* build call to printf */
    LLVMValueRef call_printf = LLVMBuildCall(jit->builder, fn, args, count + 1, "printf");
    LLVMSetTailCall(call_printf, 1);
-   LLVMAddInstrAttribute(call_printf, 0, LLVMNoUnwindAttribute);
-   LLVMAddInstrAttribute(call_printf, 1, LLVMNoAliasAttribute);
+   LLVMAddCallSiteAttribute(call_printf, LLVMAttributeFunctionIndex, llvm_attr("nounwind"));
+   LLVMAddCallSiteAttribute(call_printf, 1, llvm_attr("noalias"));
 }
 
 /*
@@ -142,13 +167,13 @@ void llvm_printbool(jit_t * jit, LLVMValueRef obj)
     LLVMPositionBuilderAtEnd(jit->builder, b1);
 
     /* print "true" */
-    llvm_printf(jit, "%s", jit->true_str);
+    llvm_printf(jit, "%s", LLVMBuildGlobalStringPtr(jit->builder, "true", ""));
 
     LLVMBuildBr(jit->builder, e);
     LLVMPositionBuilderAtEnd(jit->builder, b2);  
 
     /* print "false" */
-    llvm_printf(jit, "%s", jit->false_str);
+    llvm_printf(jit, "%s", LLVMBuildGlobalStringPtr(jit->builder, "false", ""));
 
     LLVMBuildBr(jit->builder, e);
     LLVMPositionBuilderAtEnd(jit->builder, e);
@@ -212,7 +237,7 @@ void print_obj(jit_t * jit, type_t * type, LLVMValueRef obj)
       case DATATYPE:
       case ARRAY:
       case NIL:
-         llvm_printf(jit, "%s", jit->nil_str);
+         llvm_printf(jit, "%s", LLVMBuildGlobalStringPtr(jit->builder, "nil", ""));
          break;
       case TUPLE:
          print_tuple(jit, type, obj);
@@ -221,97 +246,904 @@ void print_obj(jit_t * jit, type_t * type, LLVMValueRef obj)
 }
 
 /*
-   Initialise the LLVM JIT
+   Errors setting up the jit or handing it a module are fatal
+*/
+void llvm_check(LLVMErrorRef err)
+{
+    if (err != NULL)
+    {
+       char * msg = LLVMGetErrorMessage(err);
+       fprintf(stderr, "%s\n", msg);  
+       LLVMDisposeErrorMessage(msg);  
+       abort();  
+    }
+}
+
+/*
+   Is cpu native, or the name of a CPU we can generate code for. The C
+   API has no way to ask, and code generation fails for an unknown CPU,
+   as LLVM then assumes none of its features.
 */
-jit_t * llvm_init(void)
+int llvm_cpu_valid(const char * cpu)
 {
-    char * error = NULL;
+    const llvm::Target * target;
+    llvm::MCSubtargetInfo * info;
+    std::string msg;
+    char * triple;
+    int valid = 0;
+
+    if (strcmp(cpu, "native") == 0)
+        return 1;
+
+    LLVMInitializeNativeTarget();
+
+    triple = LLVMGetDefaultTargetTriple();
+    if ((target = llvm::TargetRegistry::lookupTarget(triple, msg)) != NULL)
+    {
+        info = target->createMCSubtargetInfo(triple, "", "");
+        valid = info->isCPUStringValid(cpu);
+        delete info;
+    }
+    LLVMDisposeMessage(triple);
+
+    return valid;
+}
+
+/*
+   Make a code generator for the CPU we compile for, see llvm_init, 
+   with the given level of optimisation, relocation and code model
+*/
+LLVMTargetMachineRef llvm_target_machine(jit_t * jit, LLVMCodeGenOptLevel level,
+                                     LLVMRelocMode reloc, LLVMCodeModel model)
+{
+    LLVMTargetMachineRef machine;
+    LLVMTargetRef target;
+    char * triple = LLVMGetDefaultTargetTriple();
+    char * msg;
+
+    if (LLVMGetTargetFromTriple(triple, &target, &msg))
+    {
+       fprintf(stderr, "%s\n", msg);
+       abort();
+    }
+
+    machine = LLVMCreateTargetMachine(target, triple, jit->cpu, jit->features, 
+                                      level, reloc, model);
+
+    LLVMDisposeMessage(triple);
+
+    return machine;
+}
+
+/*
+   The function pass pipelines of the optimisation levels, in the
+   syntax of opt -passes. Hot code is first promoted to registers by
+   SROA and cleaned up, so that the loop passes see SSA values rather
+   than allocas, then:
+
+   -O1: LICM and loop rotation, induction variable simplification
+        and loop deletion, then CSE and instcombine again
+   -O2: jump threading, tail call elimination and reassociation, LICM
+        and unswitching of rotated loops, idiom recognition, induction
+        variables, loop deletion and full unrolling, then GVN, SCCP,
+        dead code and dead store elimination, then the loop and SLP
+        vectorizers and runtime unrolling
+   -O3: as -O2 with aggressive instcombine, non-trivial unswitching 
+        and more unrolling
+
+   At -O0 nothing is optimised and every function stays at tier 0.
+*/
+const char * llvm_pipeline[] = 
+{
+   "",
+
+   "function(sroa,early-cse<memssa>,simplifycfg,instcombine,"
+   "loop-mssa(loop-rotate,licm),loop(indvars,loop-deletion),"
+   "early-cse,instcombine,simplifycfg)",
+
+   "function(sroa,early-cse<memssa>,simplifycfg,instcombine,"
+   "jump-threading,correlated-propagation,simplifycfg,instcombine,"
+   "tailcallelim,simplifycfg,reassociate,"
+   "loop-mssa(loop-rotate,licm,simple-loop-unswitch),simplifycfg,instcombine,"
+   "loop(loop-idiom,indvars,loop-deletion,loop-unroll-full),"
+   "sroa,mldst-motion,gvn,sccp,bdce,instcombine,"
+   "jump-threading,correlated-propagation,adce,memcpyopt,dse,"
+   "loop-mssa(licm),simplifycfg,instcombine,"
+   "loop-vectorize,loop-load-elim,instcombine,simplifycfg,"
+   "slp-vectorizer,vector-combine,instcombine,loop-unroll<O2>,instcombine,"
+   "loop-mssa(licm),alignment-from-assumptions,instsimplify,div-rem-pairs,simplifycfg)",
+
+   "function(sroa,early-cse<memssa>,simplifycfg,instcombine,aggressive-instcombine,"
+   "jump-threading,correlated-propagation,simplifycfg,instcombine,"
+   "tailcallelim,simplifycfg,reassociate,"
+   "loop-mssa(loop-rotate,licm,simple-loop-unswitch<nontrivial>),simplifycfg,instcombine,"
+   "loop(loop-idiom,indvars,loop-deletion,loop-unroll-full),"
+   "sroa,mldst-motion,gvn,sccp,bdce,instcombine,"
+   "jump-threading,correlated-propagation,adce,memcpyopt,dse,"
+   "loop-mssa(licm),simplifycfg,instcombine,"
+   "loop-vectorize,loop-load-elim,instcombine,simplifycfg,"
+   "slp-vectorizer,vector-combine,instcombine,loop-unroll<O3>,instcombine,"
+   "loop-mssa(licm),alignment-from-assumptions,instsimplify,div-rem-pairs,simplifycfg)"
+};
+
+/* code generator optimisation of each level */
+LLVMCodeGenOptLevel llvm_codegen_level[] = 
+{
+   LLVMCodeGenLevelNone, LLVMCodeGenLevelLess, 
+   LLVMCodeGenLevelDefault, LLVMCodeGenLevelAggressive
+};
+
+/*
+   With IPO a module is optimised as a whole: the inliner and function
+   attribute inference run bottom up over the call graph, interleaved
+   with the function pipeline, after interprocedural SCCP, and anything
+   that is no longer used is deleted afterwards
+*/
+#define IPO_BEGIN "ipsccp,cgscc(inline,function-attrs,"
+#define IPO_END "),elim-avail-extern,globaldce"
+
+/*
+   Initialise the LLVM JIT, to optimise hot code at the given level, 
+   from 0 to 3, with interprocedural optimisation if ipo is set. Code
+   is generated for the given CPU, with the features it is known to
+   have, or if cpu is NULL for the CPU we are running on, with all 
+   the features it reports, e.g. AVX2 and AVX-512 where available. The
+   CPU may also be given as native.
+*/
+jit_t * llvm_init(int level, int ipo, const char * cpu)
+{
+    LLVMOrcDefinitionGeneratorRef gen;
+    LLVMOrcLLJITBuilderRef builder;
+    LLVMJITCSymbolMapPair tier_up;
     
     /* create jit struct */
     jit_t * jit = (jit_t *) GC_MALLOC(sizeof(jit_t));
 
     /* Jit setup */
-    LLVMLinkInJIT();
     LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
 
-    /* Create module */
-    jit->module = LLVMModuleCreateWithName("cesium");
+    if (cpu == NULL || strcmp(cpu, "native") == 0)
+    {
+        char * name = LLVMGetHostCPUName();
+        char * features = LLVMGetHostCPUFeatures();
+        
+        jit->cpu = strdup(name);
+        jit->features = strdup(features);
+        
+        LLVMDisposeMessage(name);
+        LLVMDisposeMessage(features);
+    } else
+    {
+        jit->cpu = strdup(cpu);
+        jit->features = ""; /* implied by the CPU */
+    }
 
-    /* Create JIT engine */
-    if (LLVMCreateJITCompilerForModule(&(jit->engine), jit->module, 2, &error) != 0) 
-    {   
-       fprintf(stderr, "%s\n", error);  
-       LLVMDisposeMessage(error);  
-       abort();  
-    } 
-   
-    /* Create optimisation pass pipeline */
-    jit->pass = LLVMCreateFunctionPassManagerForModule(jit->module);  
-    LLVMAddTargetData(LLVMGetExecutionEngineTargetData(jit->engine), jit->pass);  
-    LLVMAddAggressiveDCEPass(jit->pass); /* */
-    LLVMAddDeadStoreEliminationPass(jit->pass); 
-    LLVMAddIndVarSimplifyPass(jit->pass); 
-    LLVMAddJumpThreadingPass(jit->pass); 
-    LLVMAddLICMPass(jit->pass); 
-    LLVMAddLoopDeletionPass(jit->pass); 
-    LLVMAddLoopRotatePass(jit->pass); 
-    LLVMAddLoopUnrollPass(jit->pass); 
-    LLVMAddLoopUnswitchPass(jit->pass);
-    LLVMAddMemCpyOptPass(jit->pass); 
-    LLVMAddReassociatePass(jit->pass); 
-    LLVMAddSCCPPass(jit->pass); 
-    LLVMAddScalarReplAggregatesPass(jit->pass); 
-    LLVMAddSimplifyLibCallsPass(jit->pass);
-    LLVMAddTailCallEliminationPass(jit->pass); 
-    LLVMAddDemoteMemoryToRegisterPass(jit->pass); /* */ 
-    LLVMAddConstantPropagationPass(jit->pass);  
-    LLVMAddInstructionCombiningPass(jit->pass);  
-    LLVMAddPromoteMemoryToRegisterPass(jit->pass);  
-    LLVMAddGVNPass(jit->pass);  
-    LLVMAddCFGSimplificationPass(jit->pass);
-    
-    /* link in external functions callable from jit'd code */
-    llvm_functions(jit);
+    /* 
+       Create JIT engine. Modules handed to it are compiled at tier 0,
+       without optimisation and with fast instruction selection, hot
+       code is compiled with jit->machine (see llvm_module_end).
+    */
+    builder = LLVMOrcCreateLLJITBuilder();
+    LLVMOrcLLJITBuilderSetJITTargetMachineBuilder(builder, 
+        LLVMOrcJITTargetMachineBuilderCreateFromTargetMachine(
+                              llvm_target_machine(jit, LLVMCodeGenLevelNone, 
+                                         LLVMRelocDefault, LLVMCodeModelJITDefault)));
+    llvm_check(LLVMOrcCreateLLJIT(&(jit->engine), builder));
+    jit->dylib = LLVMOrcLLJITGetMainJITDylib(jit->engine);
+    jit->context = LLVMOrcCreateNewThreadSafeContext();
+    jit->machine = llvm_target_machine(jit, llvm_codegen_level[level],
+                                         LLVMRelocDefault, LLVMCodeModelJITDefault);
+    jit->level = level;
+    jit->tier_size = TIER_TAB_INIT;
+    jit->tier_count = 0;
+    jit->tiers = (tier_t **) GC_MALLOC(jit->tier_size*sizeof(tier_t *));
+    
+    /* let jit'd code call functions in the process, e.g. printf */
+    llvm_check(LLVMOrcCreateDynamicLibrarySearchGeneratorForProcess(&gen, 
+                         LLVMOrcLLJITGetGlobalPrefix(jit->engine), NULL, NULL));
+    LLVMOrcJITDylibAddGenerator(jit->dylib, gen);
+
+    /* and llvm_tier_up, which need not be exported by the executable */
+    tier_up.Name = LLVMOrcLLJITMangleAndIntern(jit->engine, "llvm_tier_up");
+    tier_up.Sym.Address = (LLVMOrcExecutorAddress) llvm_tier_up;
+    tier_up.Sym.Flags.GenericFlags = LLVMJITSymbolGenericFlagsExported 
+                                   | LLVMJITSymbolGenericFlagsCallable;
+    tier_up.Sym.Flags.TargetFlags = 0;
+    llvm_check(LLVMOrcJITDylibDefine(jit->dylib, LLVMOrcAbsoluteSymbols(&tier_up, 1)));
 
-    /* initialise some strings */
-    START_EXEC;
-    jit->fmt_str = NULL;
-    jit->true_str = LLVMBuildGlobalStringPtr(jit->builder, "true", "true");
-    jit->false_str = LLVMBuildGlobalStringPtr(jit->builder, "false", "false");
-    jit->nil_str = LLVMBuildGlobalStringPtr(jit->builder, "nil", "nil");
-    END_EXEC;
+    /* 
+       Create the module of declarations. It is never jit'd, but the
+       external functions are declared in it so that nothing else can 
+       take their names.
+    */
+    jit->module = NULL;
+    llvm_module_begin(jit, "cesium");
+    jit->decls = jit->module;
+    jit->module = NULL;
+   
+    /* pass pipeline hot code is optimised with, see llvm_pipeline */
+    jit->passes = llvm_pipeline[level];
+    jit->ipo = (ipo && level > 0);
+    if (jit->ipo)
+    {
+        char * passes = (char *) GC_MALLOC(strlen(IPO_BEGIN) 
+                                 + strlen(jit->passes) + strlen(IPO_END) + 1);
+        sprintf(passes, "%s%s%s", IPO_BEGIN, jit->passes, IPO_END);
+        jit->passes = passes;
+    }
+    jit->options = LLVMCreatePassBuilderOptions();
 
     return jit;
 }
 
 /*
    If something goes wrong after partially jit'ing something we need
-   to clean up.
+   to clean up. The module we were jit'ing into is thrown away.
 */
 void llvm_reset(jit_t * jit)
 {
-    LLVMDeleteFunction(jit->function);
+    if (jit->module != NULL)
+        LLVMDisposeModule(jit->module);
     LLVMDisposeBuilder(jit->builder);
+    jit->module = NULL;
     jit->function = NULL;
     jit->builder = NULL;
     jit->breakto = NULL;
 }
 
+/*
+   Print the number of modules jit'd and the number of globals and
+   functions they export, for the stats command
+*/
+void print_jit_stats(jit_t * jit)
+{
+    LLVMValueRef v;
+    int globals = 0, functions = 0;
+
+    for (v = LLVMGetFirstGlobal(jit->decls); v != NULL; v = LLVMGetNextGlobal(v))
+        globals++;
+    for (v = LLVMGetFirstFunction(jit->decls); v != NULL; v = LLVMGetNextFunction(v))
+        functions++;
+
+    printf("jit: %ld modules (%ld removed), %d globals, %d functions, %d global bindings, %ld globals reclaimed, %ld functions re-optimised\n",
+           jit->modules, jit->removed, globals, functions, scope_globals, jit->reclaimed, jit->tiered);
+}
+
 /*
    Clean up LLVM on exit from Cesium
 */
 void llvm_cleanup(jit_t * jit)
 {
+    tier_t * t;
+    int i;
+
     /* Clean up */
-    LLVMDisposePassManager(jit->pass);  
-    LLVMDisposeExecutionEngine(jit->engine); 
-    jit->pass = NULL;
+    for (i = 0; i < jit->tier_size; i++)
+        for (t = jit->tiers[i]; t != NULL; t = t->next)
+            if (t->module != NULL)
+                LLVMDisposeModule(t->module);
+    LLVMDisposePassBuilderOptions(jit->options);
+    LLVMDisposeTargetMachine(jit->machine);
+    llvm_check(LLVMOrcDisposeLLJIT(jit->engine)); 
+    LLVMOrcDisposeThreadSafeContext(jit->context);
+    LLVMDisposeModule(jit->decls);
+    jit->options = NULL;
+    jit->machine = NULL;
+    jit->tiers = NULL;
     jit->engine = NULL;
+    jit->context = NULL;
     jit->module = NULL;
-    jit->fmt_str = NULL;
-    jit->nil_str = NULL;
-    jit->true_str = NULL;
-    jit->false_str = NULL;
+    jit->decls = NULL;
+}
+
+/*
+   Each top level statement (or script), function and global is jit'd
+   into a module of its own. Start a new module, returning the one we 
+   were jit'ing into so that llvm_module_end can go back to it.
+*/
+LLVMModuleRef llvm_module_begin(jit_t * jit, const char * name)
+{
+    LLVMModuleRef save = jit->module;
+
+    jit->module = LLVMModuleCreateWithName(name);
+    LLVMSetDataLayout(jit->module, LLVMOrcLLJITGetDataLayoutStr(jit->engine));
+    LLVMSetTarget(jit->module, LLVMOrcLLJITGetTripleString(jit->engine));
+
+    /* link in external functions callable from jit'd code */
+    llvm_functions(jit);
+
+    return save;
+}
+
+/* The function jit'd at tier 0 with the given name, if any */
+tier_t * llvm_tier_find(jit_t * jit, const char * name)
+{
+    tier_t * t = jit->tiers[sym_hash(name, strlen(name)) & (jit->tier_size - 1)];
+
+    while (t != NULL && strcmp(LLVMGetValueName(t->decl), name) != 0)
+        t = t->next;
+
+    return t;
+}
+
+/*
+   Add a function jit'd at tier 0 to jit->tiers, doubling the number
+   of buckets once there are more functions than buckets
+*/
+void llvm_tier_add(jit_t * jit, tier_t * t)
+{
+    const char * name = LLVMGetValueName(t->decl);
+    tier_t ** bucket;
+
+    if (jit->tier_count == jit->tier_size)
+    {
+        tier_t ** old = jit->tiers;
+        tier_t * u, * next;
+        int i, old_size = jit->tier_size;
+
+        jit->tier_size *= 2;
+        jit->tiers = (tier_t **) GC_MALLOC(jit->tier_size*sizeof(tier_t *));
+
+        for (i = 0; i < old_size; i++)
+        {
+            for (u = old[i]; u != NULL; u = next)
+            {
+                next = u->next;
+                name = LLVMGetValueName(u->decl);
+                bucket = jit->tiers + (sym_hash(name, strlen(name)) & (jit->tier_size - 1));
+                u->next = *bucket;
+                *bucket = u;
+            }
+        }
+
+        name = LLVMGetValueName(t->decl);
+    }
+
+    bucket = jit->tiers + (sym_hash(name, strlen(name)) & (jit->tier_size - 1));
+    t->next = *bucket;
+    *bucket = t;
+    jit->tier_count++;
+}
+
+/*
+   Forget the function with the given name, if it was jit'd at tier 0,
+   along with the copy of its module. Only done once its modules have
+   been removed, as the code counting its calls refers to the tier_t.
+*/
+void llvm_tier_drop(jit_t * jit, const char * name)
+{
+    tier_t ** p = jit->tiers + (sym_hash(name, strlen(name)) & (jit->tier_size - 1));
+    tier_t * t;
+
+    while (*p != NULL && strcmp(LLVMGetValueName((*p)->decl), name) != 0)
+        p = &(*p)->next;
+
+    if ((t = *p) == NULL)
+        return;
+
+    *p = t->next;
+    jit->tier_count--;
+
+    if (t->module != NULL)
+        LLVMDisposeModule(t->module);
+    free(t);
+}
+
+/*
+   Link a copy of the body of each function the module calls into it,
+   as an available_externally definition of the function's trampoline,
+   so that the inliner can inline it. The bodies of the functions they 
+   call are linked in as well. Bodies that are not inlined are dropped
+   again, and the calls go to the trampoline as before.
+*/
+void llvm_link_bodies(jit_t * jit, LLVMModuleRef module)
+{
+    LLVMValueRef f, next, body, decl;
+    LLVMModuleRef copy;
+    tier_t * t;
+
+    /* declarations the linker adds go at the end, so we get to them too */
+    for (f = LLVMGetFirstFunction(module); f != NULL; f = next)
+    {
+        next = LLVMGetNextFunction(f); /* f is replaced by a body linked in */
+
+        if (!LLVMIsDeclaration(f) || (t = llvm_tier_find(jit, LLVMGetValueName(f))) == NULL
+                                  || t->module == NULL)
+            continue;
+
+        const char * name = LLVMGetValueName(t->decl);
+        char buf[strlen(name) + 4];
+        
+        /* the body is <name>.t1 in the copy, see llvm_tier0 */
+        copy = LLVMCloneModule(t->module);
+        sprintf(buf, "%s.t1", name);
+        body = LLVMGetNamedFunction(copy, buf);
+        if ((decl = LLVMGetNamedFunction(copy, name)) != NULL)
+        {
+            LLVMReplaceAllUsesWith(decl, body);
+            LLVMDeleteFunction(decl);
+        }
+        LLVMSetValueName(body, name);
+        LLVMSetLinkage(body, LLVMAvailableExternallyLinkage);
+
+        if (LLVMLinkModules2(module, copy))
+            abort(); /* the linker has reported why */
+    }
+}
+
+/*
+   Run the pass pipeline of our optimisation level over a module
+*/
+void llvm_optimise(jit_t * jit, LLVMModuleRef module)
+{
+    llvm_check(LLVMRunPasses(module, jit->passes, jit->machine, jit->options));
+}
+
+/*
+   Hash everything that determines the object compiled from a module:
+   its unoptimised IR, the pass pipeline, the target and the version
+   of LLVM
+*/
+void llvm_cache_key(jit_t * jit, LLVMModuleRef module, cache_key_t * key)
+{
+    char * str[4];
+    int i;
+
+    str[0] = LLVMPrintModuleToString(module);
+    str[1] = LLVMGetTargetMachineTriple(jit->machine);
+    str[2] = LLVMGetTargetMachineCPU(jit->machine);
+    str[3] = LLVMGetTargetMachineFeatureString(jit->machine);
+
+    cache_key_init(key);
+    for (i = 0; i < 4; i++)
+    {
+        cache_hash(key, str[i], strlen(str[i]));
+        LLVMDisposeMessage(str[i]);
+    }
+    cache_hash(key, jit->passes, strlen(jit->passes));
+    cache_hash(key, LLVM_VERSION_STRING, strlen(LLVM_VERSION_STRING));
+}
+
+/*
+   Is buf an object file, rather than e.g. a truncated one
+*/
+int llvm_is_object(LLVMMemoryBufferRef buf)
+{
+    LLVMBinaryRef bin;
+    LLVMBinaryType type;
+    char * msg;
+
+    if ((bin = LLVMCreateBinary(buf, LLVMGetGlobalContext(), &msg)) == NULL)
+    {
+        LLVMDisposeMessage(msg);
+        return 0;
+    }
+
+    type = LLVMBinaryGetType(bin);
+    LLVMDisposeBinary(bin);
+
+    return type >= LLVMBinaryTypeCOFF && type <= LLVMBinaryTypeMachO64B;
+}
+
+/*
+   Hand a module to the jit. If rt is NULL the module is kept for the
+   whole session, otherwise it can be removed with rt. Unless opt is 
+   set the jit compiles it at tier 0, which is what we want for code
+   that is only run once. Otherwise it is optimised and compiled to
+   an object by jit->machine first, unless we are at -O0. If there is
+   an object cache, the object may come from there instead.
+*/
+void llvm_compile(jit_t * jit, LLVMModuleRef module, 
+                              LLVMOrcResourceTrackerRef rt, int opt)
+{
+    if (jit->program != NULL) /* compiling ahead of time */
+    {
+        if (LLVMLinkModules2(jit->program, module))
+            abort(); /* the linker has reported why */
+    } else if (opt && jit->level > 0)
+    {
+        LLVMMemoryBufferRef obj = NULL;
+        cache_key_t key;
+        char * msg, * data;
+        size_t len;
+
+        /* what we compile depends on the bodies linked in */
+        if (jit->ipo)
+            llvm_link_bodies(jit, module);
+
+        if (cache_enabled())
+        {
+            llvm_cache_key(jit, module, &key);
+            if ((data = cache_lookup(&key, &len)) != NULL)
+            {
+                obj = LLVMCreateMemoryBufferWithMemoryRangeCopy(data, len, "cached");
+                free(data);
+
+                /* the jit aborts on a broken object, so compile it again */
+                if (!llvm_is_object(obj))
+                {
+                    LLVMDisposeMemoryBuffer(obj);
+                    obj = NULL;
+                    cache_discard(&key);
+                }
+            }
+        }
+
+        if (obj == NULL)
+        {
+            llvm_optimise(jit, module);
+
+            if (LLVMTargetMachineEmitToMemoryBuffer(jit->machine, module, 
+                                                     LLVMObjectFile, &msg, &obj))
+            {
+               fprintf(stderr, "%s\n", msg);
+               abort();
+            }
+
+            if (cache_enabled())
+                cache_store(&key, LLVMGetBufferStart(obj), LLVMGetBufferSize(obj));
+        }
+        LLVMDisposeModule(module);
+
+        if (rt == NULL)
+            llvm_check(LLVMOrcLLJITAddObjectFile(jit->engine, jit->dylib, obj));
+        else
+            llvm_check(LLVMOrcLLJITAddObjectFileWithRT(jit->engine, rt, obj));
+    } else
+    {
+        /* all modules are in the global context, so this is only a lock */
+        LLVMOrcThreadSafeModuleRef tsm = 
+            LLVMOrcCreateNewThreadSafeModule(module, jit->context);
+    
+        if (rt == NULL)
+            llvm_check(LLVMOrcLLJITAddLLVMIRModule(jit->engine, jit->dylib, tsm));
+        else
+            llvm_check(LLVMOrcLLJITAddLLVMIRModuleWithRT(jit->engine, rt, tsm));
+    }
+
+    jit->modules++;
+}
+
+/*
+   Compile the script ahead of time instead of running it. Every module
+   is linked into one program module, see llvm_emit_program.
+*/
+void llvm_program_begin(jit_t * jit)
+{
+    LLVMTypeRef main_type = LLVMFunctionType(LLVMInt32Type(), NULL, 0, 0);
+    
+    jit->program = LLVMModuleCreateWithName("program");
+    LLVMSetDataLayout(jit->program, LLVMOrcLLJITGetDataLayoutStr(jit->engine));
+    LLVMSetTarget(jit->program, LLVMOrcLLJITGetTripleString(jit->engine));
+
+    /* so that a Cesium function called main gets another name */
+    LLVMAddFunction(jit->decls, "main", main_type);
+}
+
+/*
+   Write the program compiled ahead of time to an object file, with a
+   main function which runs the script. Only main is exported, so that 
+   the optimiser sees the whole program. Returns 0 on success.
+*/
+int llvm_emit_program(jit_t * jit, const char * path)
+{
+    LLVMModuleRef program = jit->program;
+    LLVMTypeRef main_type = LLVMFunctionType(LLVMInt32Type(), NULL, 0, 0);
+    LLVMTypeRef init_type = LLVMFunctionType(LLVMVoidType(), NULL, 0, 0);
+    LLVMBuilderRef builder = LLVMCreateBuilder();
+    LLVMTargetMachineRef machine;
+    LLVMValueRef main, v;
+    char * msg;
+    int err;
+
+    for (v = LLVMGetFirstFunction(program); v != NULL; v = LLVMGetNextFunction(v))
+        if (!LLVMIsDeclaration(v))
+            LLVMSetLinkage(v, LLVMInternalLinkage);
+    for (v = LLVMGetFirstGlobal(program); v != NULL; v = LLVMGetNextGlobal(v))
+        if (!LLVMIsDeclaration(v))
+            LLVMSetLinkage(v, LLVMInternalLinkage);
+
+    main = LLVMAddFunction(program, "main", main_type);
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlock(main, "entry"));
+#ifdef CS_INIT_NAME
+    LLVMBuildCall2(builder, init_type, LLVMAddFunction(program, CS_INIT_NAME, init_type), NULL, 0, "");
+#endif
+    v = LLVMGetNamedFunction(program, "script");
+    LLVMBuildCall2(builder, LLVMGlobalGetValueType(v), v, NULL, 0, "");
+    LLVMBuildRet(builder, LLVMConstInt(LLVMInt32Type(), 0, 0));
+    LLVMDisposeBuilder(builder);
+
+    if (TRACE)
+       LLVMDumpModule(program);
+
+    /* position independent, as executables usually are */
+    machine = llvm_target_machine(jit, llvm_codegen_level[jit->level], 
+                                  LLVMRelocPIC, LLVMCodeModelDefault);
+    
+    if (jit->level > 0)
+        llvm_check(LLVMRunPasses(program, jit->passes, machine, jit->options));
+
+    if ((err = LLVMTargetMachineEmitToFile(machine, program, (char *) path, 
+                                              LLVMObjectFile, &msg)))
+    {
+        fprintf(stderr, "%s: %s\n", path, msg);
+        LLVMDisposeMessage(msg);
+    }
+
+    LLVMDisposeTargetMachine(machine);
+    LLVMDisposeModule(program);
+    jit->program = NULL;
+
+    return err;
+}
+
+/*
+   Hand the module we are jit'ing into to the jit, see llvm_compile,
+   and go back to the saved one
+*/
+void llvm_module_end(jit_t * jit, LLVMModuleRef save, 
+                               LLVMOrcResourceTrackerRef rt, int opt)
+{
+    llvm_compile(jit, jit->module, rt, opt);
+
+    jit->module = save;
+}
+
+/*
+   Called by the code of a function jit'd at tier 0 once it is hot. The
+   copy of its module we kept is optimised and compiled, then the
+   trampoline callers link to is pointed at the new code. Calls that
+   are already running carry on in the tier 0 code.
+*/
+void llvm_tier_up(tier_t * t)
+{
+    jit_t * jit = t->jit;
+    const char * name = LLVMGetValueName(t->decl);
+    char buf[strlen(name) + 5];
+    LLVMOrcExecutorAddress fn, ptr;
+    LLVMErrorRef err;
+
+    /* with IPO the copy is kept, for callers to inline */
+    if (jit->ipo)
+        llvm_compile(jit, LLVMCloneModule(t->module), t->rt, 1);
+    else
+    {
+        llvm_compile(jit, t->module, t->rt, 1);
+        t->module = NULL;
+    }
+
+    /* if that fails, the jit has reported why, and we stay at tier 0 */
+    sprintf(buf, "%s.t1", name);
+    if ((err = LLVMOrcLLJITLookup(jit->engine, &fn, buf)) != NULL)
+    {
+        LLVMConsumeError(err);
+        return;
+    }
+    
+    sprintf(buf, "%s.ptr", name);
+    llvm_check(LLVMOrcLLJITLookup(jit->engine, &ptr, buf));
+    
+    __atomic_store_n((LLVMOrcExecutorAddress *) ptr, fn, __ATOMIC_RELEASE);
+    jit->tiered++;
+}
+
+/*
+   Finish jit'ing a function at tier 0, fn, which calls tick on entry.
+   A copy of its module, without the calls to tick, is kept to 
+   re-optimise it with. tick is given a body that counts the calls. Callers 
+   link to a trampoline which jumps through <name>.ptr to the tier 0 
+   code, until llvm_tier_up swaps in the optimised code. The optimised
+   code is removed along with the function's module, by rt.
+*/
+void llvm_tier0(jit_t * jit, LLVMValueRef tramp, LLVMValueRef fn, 
+                         LLVMValueRef tick, LLVMOrcResourceTrackerRef rt)
+{
+    char * name = (char *) LLVMGetValueName(tramp);
+    char buf[strlen(name) + 7];
+    tier_t * t = (tier_t *) calloc(1, sizeof(tier_t)); /* only jit'd code may refer to it */
+    LLVMValueRef f, v, count, ptr, hot;
+    LLVMBuilderRef builder = LLVMCreateBuilder();
+    LLVMBasicBlockRef entry, up, done;
+    LLVMUseRef use;
+    int i, params = LLVMCountParams(tramp);
+    LLVMValueRef * args = (LLVMValueRef *) arena_alloc(params*sizeof(LLVMValueRef));
+    
+    /* copy the module, the function becomes <name>.t1 in the copy */
+    t->jit = jit;
+    t->rt = rt;
+    t->decl = LLVMGetNamedFunction(jit->decls, name);
+    t->module = LLVMCloneModule(jit->module);
+    llvm_tier_add(jit, t);
+
+    f = LLVMGetNamedFunction(t->module, LLVMGetValueName(tick));
+    while ((use = LLVMGetFirstUse(f)) != NULL)
+        LLVMInstructionEraseFromParent(LLVMGetUser(use));
+    LLVMDeleteFunction(f);
+
+    sprintf(buf, "%s.t1", name);
+    f = LLVMGetNamedFunction(t->module, LLVMGetValueName(fn));
+    LLVMSetValueName(f, buf);
+    LLVMSetLinkage(f, LLVMExternalLinkage);
+
+    /* the counter, which calls llvm_tier_up(t) once when the function is hot */
+    sprintf(buf, "%s.count", name);
+    count = LLVMAddGlobal(jit->module, LLVMWordType(), buf);
+    LLVMSetInitializer(count, LLVMConstInt(LLVMWordType(), 0, 0));
+    LLVMSetLinkage(count, LLVMPrivateLinkage);
+
+    entry = LLVMAppendBasicBlock(tick, "entry");
+    up = LLVMAppendBasicBlock(tick, "up");
+    done = LLVMAppendBasicBlock(tick, "done");
+    LLVMPositionBuilderAtEnd(builder, entry);
+    v = LLVMBuildLoad2(builder, LLVMWordType(), count, "count");
+    v = LLVMBuildAdd(builder, v, LLVMConstInt(LLVMWordType(), 1, 0), "count");
+    LLVMBuildStore(builder, v, count);
+    hot = LLVMBuildICmp(builder, LLVMIntEQ, v, LLVMConstInt(LLVMWordType(), TIER_UP, 0), "hot");
+    LLVMBuildCondBr(builder, hot, up, done);
+    LLVMPositionBuilderAtEnd(builder, up);
+    v = LLVMConstInt(LLVMWordType(), (unsigned long) t, 0);
+    v = LLVMConstIntToPtr(v, LLVMPointerType(LLVMInt8Type(), 0));
+    f = LLVMGetNamedFunction(jit->module, "llvm_tier_up");
+    LLVMBuildCall2(builder, LLVMGlobalGetValueType(f), f, &v, 1, "");
+    LLVMBuildBr(builder, done);
+    LLVMPositionBuilderAtEnd(builder, done);
+    LLVMBuildRetVoid(builder);
+    LLVMSetLinkage(tick, LLVMInternalLinkage);
+
+    /* the pointer to the current code of the function */
+    sprintf(buf, "%s.ptr", name);
+    ptr = LLVMAddGlobal(jit->module, LLVMTypeOf(fn), buf);
+    LLVMSetInitializer(ptr, fn);
+
+    /* the trampoline */
+    entry = LLVMAppendBasicBlock(tramp, "entry");
+    LLVMPositionBuilderAtEnd(builder, entry);
+    for (i = 0; i < params; i++)
+        args[i] = LLVMGetParam(tramp, i);
+    f = LLVMBuildLoad2(builder, LLVMGlobalGetValueType(ptr), ptr, "fn");
+    LLVMSetOrdering(f, LLVMAtomicOrderingAcquire);
+    LLVMSetAlignment(f, sizeof(void *));
+    v = LLVMBuildCall2(builder, LLVMGlobalGetValueType(tramp), f, args, params, "");
+    LLVMSetTailCall(v, 1);
+    if (LLVMGetTypeKind(LLVMGetReturnType(LLVMGlobalGetValueType(tramp))) == LLVMVoidTypeKind)
+        LLVMBuildRetVoid(builder);
+    else
+        LLVMBuildRet(builder, v);
+    
+    LLVMDisposeBuilder(builder);
+}
+
+/*
+   Add a function to the module we are jit'ing into. Everything a 
+   module exports is also declared in jit->decls, which gives it a name
+   no other module uses. Bindings refer to that declaration, as the
+   module itself belongs to the jit once it has been handed over.
+*/
+LLVMValueRef llvm_add_function(jit_t * jit, const char * name, LLVMTypeRef type)
+{
+    LLVMValueRef decl = LLVMAddFunction(jit->decls, name, type);
+
+    return LLVMAddFunction(jit->module, LLVMGetValueName(decl), type);
+}
+
+/*
+   Jit a global into a module of its own, so that the module can be
+   removed again once nothing refers to the global. If rt is NULL the
+   global is kept for the whole session. The declaration of the global
+   in jit->decls is returned.
+*/
+LLVMValueRef llvm_add_global(jit_t * jit, const char * name, LLVMValueRef init, 
+                                 int constant, LLVMOrcResourceTrackerRef * rt)
+{
+    LLVMTypeRef type = LLVMTypeOf(init);
+    LLVMValueRef decl = LLVMAddGlobal(jit->decls, type, name);
+    LLVMSetGlobalConstant(decl, constant);
+
+    LLVMModuleRef save = llvm_module_begin(jit, name);
+    LLVMValueRef global = LLVMAddGlobal(jit->module, type, LLVMGetValueName(decl));
+    LLVMSetInitializer(global, init);
+    LLVMSetGlobalConstant(global, constant);
+
+    if (rt != NULL)
+        *rt = LLVMOrcJITDylibCreateResourceTracker(jit->dylib);
+    llvm_module_end(jit, save, rt == NULL ? NULL : *rt, 0);
+
+    return decl;
+}
+
+/*
+   Given a declaration from jit->decls, return the same global or 
+   function in the module we are jit'ing into, declaring it there if
+   need be. The jit links the declaration to the module defining it.
+   Any other value is returned as is.
+*/
+LLVMValueRef llvm_import(jit_t * jit, LLVMValueRef val)
+{
+    const char * name;
+    LLVMValueRef v;
+
+    if (val == NULL || !LLVMIsAGlobalValue(val) || LLVMGetGlobalParent(val) != jit->decls)
+        return val;
+
+    name = LLVMGetValueName(val);
+    
+    if (LLVMIsAFunction(val))
+    {
+        if ((v = LLVMGetNamedFunction(jit->module, name)) == NULL)
+            v = LLVMAddFunction(jit->module, name, LLVMGlobalGetValueType(val));
+    } else if ((v = LLVMGetNamedGlobal(jit->module, name)) == NULL)
+    {
+        v = LLVMAddGlobal(jit->module, LLVMGlobalGetValueType(val), name);
+        LLVMSetGlobalConstant(v, LLVMIsGlobalConstant(val));
+    }
+
+    return v;
+}
+
+/*
+   Hand the module of an exec function, which we are jit'ing into, to
+   the jit and return the address of the function. If nothing else 
+   in the module can be used once the function has run, rt is set to 
+   a tracker to remove the module with, otherwise rt is set to NULL 
+   and the module is kept.
+*/
+LLVMOrcExecutorAddress llvm_exec_module(jit_t * jit, LLVMModuleRef save, 
+                                          LLVMOrcResourceTrackerRef * rt)
+{
+    LLVMOrcExecutorAddress addr;
+    LLVMErrorRef err;
+    LLVMValueRef f, g;
+    int keep = 0;
+
+    /* e.g. a lambda is only called after the exec function has run */
+    for (f = LLVMGetFirstFunction(jit->module); f != NULL; f = LLVMGetNextFunction(f))
+        if (f != jit->function && !LLVMIsDeclaration(f))
+            keep = 1;
+    for (g = LLVMGetFirstGlobal(jit->module); g != NULL; g = LLVMGetNextGlobal(g))
+        if (LLVMGetLinkage(g) != LLVMPrivateLinkage && !LLVMIsDeclaration(g))
+            keep = 1;
+    
+    /* the name in jit->decls outlives the module */
+    LLVMValueRef decl = LLVMGetNamedFunction(jit->decls, LLVMGetValueName(jit->function));
+    
+    *rt = LLVMOrcJITDylibCreateResourceTracker(jit->dylib);
+    llvm_module_end(jit, save, *rt, jit->opt);
+
+    /* 
+       look the function up, which compiles the module, the jit has 
+       already reported why if that fails
+    */
+    if ((err = LLVMOrcLLJITLookup(jit->engine, &addr, LLVMGetValueName(decl))) != NULL)
+    {
+        LLVMConsumeError(err);
+        llvm_exec_done(jit, *rt);
+        LLVMDeleteFunction(decl);
+        jit_exception(jit, "Unable to link jit'd code\n");
+    }
+
+    if (keep) /* the jit keeps the module until the session ends */
+    {
+        LLVMOrcReleaseResourceTracker(*rt);
+        *rt = NULL;
+    } else /* nothing will look the function up again */
+        LLVMDeleteFunction(decl);
+
+    return addr;
+}
+
+/*
+   Remove the module of an exec function that has been run, if that
+   is possible, see llvm_exec_module
+*/
+void llvm_exec_done(jit_t * jit, LLVMOrcResourceTrackerRef rt)
+{
+    if (rt != NULL)
+    {
+        llvm_check(LLVMOrcResourceTrackerRemove(rt));
+        LLVMOrcReleaseResourceTracker(rt);
+        jit->removed++;
+    }
 }
 
 int is_atomic(type_t * type)
@@ -351,14 +1183,23 @@ LLVMValueRef LLVMBuildGCArrayMalloc(jit_t * jit, LLVMTypeRef type, LLVMValueRef
     return LLVMBuildPointerCast(jit->builder, gcmalloc, LLVMPointerType(type, 0), name);
 }
 
+/* 
+   The LLVM types built below are cached on the canonical instance of
+   the type, if it has one, so each is only built once per session
+*/
+
 /* Build llvm lambda fn type from ordinary function type  */
 LLVMTypeRef lambda_fn_type(jit_t * jit, type_t * type)
 {
     int params = type->arity;
     int i;
+    type_t * c = type_canon(type);
+
+    if (c != NULL && c->llvm_fn != NULL)
+        return c->llvm_fn;
 
     /* get parameter types, one extra for the environment struct */
-    LLVMTypeRef * args = (LLVMTypeRef *) GC_MALLOC((params + 1)*sizeof(LLVMTypeRef));
+    LLVMTypeRef * args = (LLVMTypeRef *) arena_alloc((params + 1)*sizeof(LLVMTypeRef));
     for (i = 0; i < params; i++)
         args[i] = type_to_llvm(jit, type->param[i]); 
 
@@ -369,7 +1210,12 @@ LLVMTypeRef lambda_fn_type(jit_t * jit, type_t * type)
     LLVMTypeRef ret = type_to_llvm(jit, type->ret); 
     
     /* make LLVM function type */
-    return LLVMFunctionType(ret, args, params + 1, 0);
+    LLVMTypeRef fn_ty = LLVMFunctionType(ret, args, params + 1, 0);
+
+    if (c != NULL)
+        c->llvm_fn = fn_ty;
+
+    return fn_ty;
 }
 
 /* 
@@ -377,49 +1223,87 @@ LLVMTypeRef lambda_fn_type(jit_t * jit, type_t * type)
 */
 LLVMTypeRef lambda_type(jit_t * jit, type_t * type)
 {
+    type_t * c = type_canon(type);
+
+    if (c != NULL && c->llvm_s != NULL)
+        return c->llvm_s;
+
     LLVMTypeRef fn_ty = lambda_fn_type(jit, type);
     
     /* get lambda struct element types */
-    LLVMTypeRef * str_ty = (LLVMTypeRef *) GC_MALLOC(2*sizeof(LLVMTypeRef));
+    LLVMTypeRef * str_ty = (LLVMTypeRef *) arena_alloc(2*sizeof(LLVMTypeRef));
     str_ty[0] = LLVMPointerType(fn_ty, 0);
     str_ty[1] = LLVMPointerType(LLVMInt8Type(), 0);
 
-    return LLVMStructType(str_ty, 2, 1);
+    LLVMTypeRef s = LLVMStructType(str_ty, 2, 1);
+
+    if (c != NULL)
+        c->llvm_s = s;
+
+    return s;
 }
 
-/* Build llvm struct type from ordinary tuple type  */
+/* 
+   Build llvm struct type from ordinary tuple type. A datatype gets 
+   a struct named after it, so that it reads well in the IR
+*/
 LLVMTypeRef tup_type(jit_t * jit, type_t * type)
 {
     int params = type->arity;
     int i;
+    type_t * c = type_canon(type);
+    LLVMTypeRef s;
+
+    if (c != NULL && c->llvm_s != NULL)
+        return c->llvm_s;
 
     /* get parameter types */
-    LLVMTypeRef * args = (LLVMTypeRef *) GC_MALLOC(params*sizeof(LLVMTypeRef));
+    LLVMTypeRef * args = (LLVMTypeRef *) arena_alloc(params*sizeof(LLVMTypeRef));
     for (i = 0; i < params; i++)
         args[i] = type_to_llvm(jit, type->param[i]); 
 
     /* make LLVM struct type */
-    return LLVMStructType(args, params, 1);
+    if (c != NULL && c->typ == DATATYPE)
+    {
+        s = LLVMStructCreateNamed(LLVMGetGlobalContext(), c->sym->name);
+        LLVMStructSetBody(s, args, params, 1);
+    } else
+        s = LLVMStructType(args, params, 1);
+
+    if (c != NULL)
+        c->llvm_s = s;
+
+    return s;
 }
 
 /* Build llvm struct type for array type  */
 LLVMTypeRef arr_type(jit_t * jit, type_t * type)
 {
-    int i;
+    type_t * c = type_canon(type);
+
+    if (c != NULL && c->llvm_s != NULL)
+        return c->llvm_s;
 
     /* get parameter types */
-    LLVMTypeRef * args = (LLVMTypeRef *) GC_MALLOC(2*sizeof(LLVMTypeRef));
+    LLVMTypeRef * args = (LLVMTypeRef *) arena_alloc(2*sizeof(LLVMTypeRef));
     args[0] = LLVMPointerType(type_to_llvm(jit, type->ret), 0); 
     args[1] = LLVMWordType();
 
     /* make LLVM struct type */
-    return LLVMStructType(args, 2, 1);
+    LLVMTypeRef s = LLVMStructType(args, 2, 1);
+
+    if (c != NULL)
+        c->llvm_s = s;
+
+    return s;
 }
 
 /* Convert a type to an LLVMTypeRef */
 LLVMTypeRef type_to_llvm(jit_t * jit, type_t * type)
 {
     int i;
+    type_t * c;
+    LLVMTypeRef t;
     
     if (type == t_double)
          return LLVMDoubleType();
@@ -433,12 +1317,16 @@ LLVMTypeRef type_to_llvm(jit_t * jit, type_t * type)
          return LLVMInt8Type();
     else if (type == t_nil)
          return LLVMVoidType();
-    else if (type->typ == FN)
+    
+    if ((c = type_canon(type)) != NULL && c->llvm != NULL)
+        return c->llvm;
+
+    if (type->typ == FN)
     {
         int params = type->arity;
         
         /* get parameter types */
-        LLVMTypeRef * args = (LLVMTypeRef *) GC_MALLOC(params*sizeof(LLVMTypeRef));
+        LLVMTypeRef * args = (LLVMTypeRef *) arena_alloc(params*sizeof(LLVMTypeRef));
         for (i = 0; i < params; i++)
             args[i] = type_to_llvm(jit, type->param[i]); 
 
@@ -446,17 +1334,22 @@ LLVMTypeRef type_to_llvm(jit_t * jit, type_t * type)
         LLVMTypeRef ret = type_to_llvm(jit, type->ret); 
     
         /* make LLVM function type */
-        return LLVMPointerType(LLVMFunctionType(ret, args, params, 0), 0);
+        t = LLVMPointerType(LLVMFunctionType(ret, args, params, 0), 0);
     } else if (type->typ == LAMBDA)
-        return LLVMPointerType(lambda_type(jit, type), 0);
+        t = LLVMPointerType(lambda_type(jit, type), 0);
     else if (type->typ == TUPLE || type->typ == DATATYPE)
-        return LLVMPointerType(tup_type(jit, type), 0);
+        t = LLVMPointerType(tup_type(jit, type), 0);
     else if (type->typ == ARRAY)
-        return LLVMPointerType(arr_type(jit, type), 0);
+        t = LLVMPointerType(arr_type(jit, type), 0);
     else if (type->typ == TYPEVAR)
         jit_exception(jit, "Unable to infer types\n");
     else
         jit_exception(jit, "Internal error: unknown type in type_to_llvm\n");
+
+    if (c != NULL)
+        c->llvm = t;
+
+    return t;
 }
 
 /*
@@ -464,9 +1357,7 @@ LLVMTypeRef type_to_llvm(jit_t * jit, type_t * type)
 */
 int exec_int(jit_t * jit, ast_t * ast)
 {
-    long num = atol(ast->sym->name);
-    
-    ast->val = LLVMConstInt(LLVMWordType(), num, 0);
+    AST_VAL(ast) = LLVMConstInt(LLVMWordType(), ast->ival, 0);
 
     return 0;
 }
@@ -476,9 +1367,7 @@ int exec_int(jit_t * jit, ast_t * ast)
 */
 int exec_double(jit_t * jit, ast_t * ast)
 {
-    double num = atof(ast->sym->name);
-    
-    ast->val = LLVMConstReal(LLVMDoubleType(), num);
+    AST_VAL(ast) = LLVMConstReal(LLVMDoubleType(), ast->dval);
 
     return 0;
 }
@@ -488,74 +1377,28 @@ int exec_double(jit_t * jit, ast_t * ast)
 */
 int exec_bool(jit_t * jit, ast_t * ast)
 {
-    if (strcmp(ast->sym->name, "true") == 0)
-        ast->val = LLVMConstInt(LLVMInt1Type(), 1, 0);
-    else
-        ast->val = LLVMConstInt(LLVMInt1Type(), 0, 0);
+    AST_VAL(ast) = LLVMConstInt(LLVMInt1Type(), ast->ival, 0);
 
     return 0;
 }
 
 /*
-   Jit a string literali, being careful to replace special 
-   characters with their ascii equivalent
+   Jit a string literal. Escape sequences were dealt with by the 
+   parser and each distinct string only gets one global, which is 
+   kept for the whole session as the string may be stored anywhere.
 */
 int exec_string(jit_t * jit, ast_t * ast)
 {
-    char * name = ast->sym->name;
+    lit_t * lit = ast->str;
          
-    if (ast->sym->val == NULL)
+    if (lit->val == NULL)
     {
-        int length = strlen(name) - 2;
-        int i, j, bs = 0;
-            
-        for (i = 0; i < length; i++)
-        {
-            if (name[i + 1] == '\\')
-            { 
-                bs++;
-                i++;
-            }
-        }
-
-        char * str = (char *) GC_MALLOC(length + 1 - bs);
-            
-        for (i = 0, j = 0; i < length; i++, j++)
-        {
-            if (name[i + 1] == '\\')
-            {
-                switch (name[i + 2])
-                {
-                case '0':
-                    str[j] = '\0';
-                    break;
-                case '\\':
-                    str[j] = '\\';
-                    break;
-                case 'n':
-                    str[j] = '\n';
-                    break;
-                case 'r':
-                    str[j] = '\r';
-                    break;
-                case 't':
-                    str[j] = '\t';
-                    break;
-                default:
-                    str[j] = name[i + 2];
-                }
-                i++;
-            } else
-                str[j] = name[i + 1];
-        }
-
-        length = length - bs;
-        str[length] = '\0';
-            
-        ast->sym->val = LLVMBuildGlobalStringPtr(jit->builder, str, "string");
+        LLVMValueRef str = LLVMConstString(lit->str, strlen(lit->str), 0);
+        lit->val = llvm_add_global(jit, "string", str, 1, NULL);
     }
 
-    ast->val = ast->sym->val;
+    LLVMValueRef indices[2] = { LLVMConstInt(LLVMInt32Type(), 0, 0), LLVMConstInt(LLVMInt32Type(), 0, 0) };
+    AST_VAL(ast) = LLVMConstInBoundsGEP(llvm_import(jit, lit->val), indices, 2);
 
     return 0;
 }
@@ -571,12 +1414,12 @@ __name(jit_t * jit, ast_t * ast)                        \
                                                         \
     exec_ast(jit, expr1);                               \
                                                         \
-    LLVMValueRef v1 = expr1->val;                       \
+    LLVMValueRef v1 = AST_VAL(expr1);                   \
                                                         \
     if (expr1->type == t_double)                        \
-       ast->val = __fop(jit->builder, v1, __str);       \
+       AST_VAL(ast) = __fop(jit->builder, v1, __str);   \
     else                                                \
-       ast->val = __iop(jit->builder, v1, __str);       \
+       AST_VAL(ast) = __iop(jit->builder, v1, __str);   \
                                                         \
     ast->type = expr1->type;                            \
                                                         \
@@ -590,9 +1433,9 @@ __name(jit_t * jit, ast_t * ast)                        \
                                                         \
     exec_ast(jit, expr1);                               \
                                                         \
-    LLVMValueRef v1 = expr1->val;                       \
+    LLVMValueRef v1 = AST_VAL(expr1);                   \
                                                         \
-    ast->val = __iop(jit->builder, v1, __str);          \
+    AST_VAL(ast) = __iop(jit->builder, v1, __str);      \
                                                         \
     ast->type = expr1->type;                            \
                                                         \
@@ -607,15 +1450,15 @@ __name(jit_t * jit, ast_t * ast)                                \
     exec_place(jit, expr1);                                     \
                                                                 \
     LLVMValueRef v1 = LLVMBuildLoad(jit->builder,               \
-                      expr1->val, expr1->sym->name);            \
+                      AST_VAL(expr1), expr1->sym->name);        \
                                                                 \
     if (expr1->type == t_double)                                \
-       ast->val = __fop(jit->builder, v1,                       \
+       AST_VAL(ast) = __fop(jit->builder, v1,                   \
           LLVMConstReal(LLVMDoubleType(), __c1), __str);        \
     else                                                        \
-       ast->val = __iop(jit->builder, v1,                       \
+       AST_VAL(ast) = __iop(jit->builder, v1,                   \
           LLVMConstInt(LLVMWordType(), __c2, 0), __str);        \
-    LLVMBuildStore(jit->builder, ast->val, expr1->val);         \
+    LLVMBuildStore(jit->builder, AST_VAL(ast), AST_VAL(expr1)); \
                                                                 \
     ast->type = expr1->type;                                    \
                                                                 \
@@ -630,18 +1473,18 @@ __name(jit_t * jit, ast_t * ast)                                 \
     exec_place(jit, expr1);                                      \
                                                                  \
     LLVMValueRef v1 = LLVMBuildLoad(jit->builder,                \
-                      expr1->val, expr1->sym->name);             \
+                      AST_VAL(expr1), expr1->sym->name);         \
                                                                  \
     if (expr1->type == t_double)                                 \
-       ast->val = __fop(jit->builder, v1,                        \
+       AST_VAL(ast) = __fop(jit->builder, v1,                    \
           LLVMConstReal(LLVMDoubleType(), __c1), __str);         \
     else                                                         \
-       ast->val = __iop(jit->builder, v1,                        \
+       AST_VAL(ast) = __iop(jit->builder, v1,                    \
           LLVMConstInt(LLVMWordType(), __c2, 0), __str);         \
-    LLVMBuildStore(jit->builder, ast->val, expr1->val);          \
+    LLVMBuildStore(jit->builder, AST_VAL(ast), AST_VAL(expr1));  \
                                                                  \
     ast->type = expr1->type;                                     \
-    ast->val = v1;                                               \
+    AST_VAL(ast) = v1;                                           \
                                                                  \
     return 0;                                                    \
 }
@@ -674,12 +1517,12 @@ __name(jit_t * jit, ast_t * ast)                        \
     exec_ast(jit, expr1);                               \
     exec_ast(jit, expr2);                               \
                                                         \
-    LLVMValueRef v1 = expr1->val, v2 = expr2->val;      \
+    LLVMValueRef v1 = AST_VAL(expr1), v2 = AST_VAL(expr2); \
                                                         \
     if (expr1->type == t_double)                        \
-       ast->val = __fop(jit->builder, v1, v2, __str);   \
+       AST_VAL(ast) = __fop(jit->builder, v1, v2, __str); \
     else                                                \
-       ast->val = __iop(jit->builder, v1, v2, __str);   \
+       AST_VAL(ast) = __iop(jit->builder, v1, v2, __str); \
                                                         \
     ast->type = expr1->type;                            \
                                                         \
@@ -695,12 +1538,12 @@ __name(jit_t * jit, ast_t * ast)                                      \
     exec_ast(jit, expr1);                                             \
     exec_ast(jit, expr2);                                             \
                                                                       \
-    LLVMValueRef v1 = expr1->val, v2 = expr2->val;                    \
+    LLVMValueRef v1 = AST_VAL(expr1), v2 = AST_VAL(expr2);            \
                                                                       \
     if (expr1->type == t_double)                                      \
-       ast->val = __fop(jit->builder, __frel, v1, v2, __str);         \
+       AST_VAL(ast) = __fop(jit->builder, __frel, v1, v2, __str);     \
     else                                                              \
-       ast->val = __iop(jit->builder, __irel, v1, v2, __str);         \
+       AST_VAL(ast) = __iop(jit->builder, __irel, v1, v2, __str);     \
                                                                       \
     return 0;                                                         \
 }
@@ -714,9 +1557,9 @@ __name(jit_t * jit, ast_t * ast)                        \
     exec_ast(jit, expr1);                               \
     exec_ast(jit, expr2);                               \
                                                         \
-    LLVMValueRef v1 = expr1->val, v2 = expr2->val;      \
+    LLVMValueRef v1 = AST_VAL(expr1), v2 = AST_VAL(expr2); \
                                                         \
-    ast->val = __iop(jit->builder, v1, v2, __str);      \
+    AST_VAL(ast) = __iop(jit->builder, v1, v2, __str);  \
                                                         \
     ast->type = expr1->type;                            \
                                                         \
@@ -733,13 +1576,13 @@ __name(jit_t * jit, ast_t * ast)                              \
     exec_ast(jit, expr2);                                     \
                                                               \
     LLVMValueRef v1 = LLVMBuildLoad(jit->builder,             \
-                      expr1->val, expr1->sym->name);          \
+                      AST_VAL(expr1), expr1->sym->name);      \
                                                               \
     if (expr1->type == t_double)                              \
-       ast->val = __fop(jit->builder, v1, expr2->val, __str); \
+       AST_VAL(ast) = __fop(jit->builder, v1, AST_VAL(expr2), __str); \
     else                                                      \
-       ast->val = __iop(jit->builder, v1, expr2->val, __str); \
-    LLVMBuildStore(jit->builder, ast->val, expr1->val);       \
+       AST_VAL(ast) = __iop(jit->builder, v1, AST_VAL(expr2), __str); \
+    LLVMBuildStore(jit->builder, AST_VAL(ast), AST_VAL(expr1)); \
                                                               \
     ast->type = expr1->type;                                  \
                                                               \
@@ -756,10 +1599,10 @@ __name(jit_t * jit, ast_t * ast)                              \
     exec_ast(jit, expr2);                                     \
                                                               \
     LLVMValueRef v1 = LLVMBuildLoad(jit->builder,             \
-                      expr1->val, expr1->sym->name);          \
+                      AST_VAL(expr1), expr1->sym->name);      \
                                                               \
-    ast->val = __iop(jit->builder, v1, expr2->val, __str);    \
-    LLVMBuildStore(jit->builder, ast->val, expr1->val);       \
+    AST_VAL(ast) = __iop(jit->builder, v1, AST_VAL(expr2), __str); \
+    LLVMBuildStore(jit->builder, AST_VAL(ast), AST_VAL(expr1)); \
                                                               \
     ast->type = expr1->type;                                  \
                                                               \
@@ -830,8 +1673,9 @@ int exec_binary_pre1(exec_rsheq, LLVMBuildAShr, "rsheq")
 LLVMValueRef make_fn_lambda(jit_t * jit,  
                              LLVMValueRef fn, LLVMTypeRef fn_type)
 {
-    /* make llvm function object */
+    /* make llvm function object, only ever called through a lambda struct */
     LLVMValueRef fn_res = LLVMAddFunction(jit->module, "lambda", fn_type);
+    LLVMSetLinkage(fn_res, LLVMInternalLinkage);
     
     /* jit setup */
     LLVMBuilderRef build_res = LLVMCreateBuilder();
@@ -842,7 +1686,7 @@ LLVMValueRef make_fn_lambda(jit_t * jit,
        
     /* make space for arguments */
     int count = LLVMCountParams(fn);
-    LLVMValueRef * args = (LLVMValueRef *) GC_MALLOC(count*sizeof(LLVMValueRef));
+    LLVMValueRef * args = (LLVMValueRef *) arena_alloc(count*sizeof(LLVMValueRef));
     
     /* load arguments */
     int i = 0;
@@ -853,9 +1697,6 @@ LLVMValueRef make_fn_lambda(jit_t * jit,
     LLVMValueRef ret = LLVMBuildCall(build_res, fn, args, count, "");
     LLVMBuildRet(build_res, ret);
     
-    /* run the pass manager on the jit'd function */
-    LLVMRunFunctionPassManager(jit->pass, fn_res); 
-    
     /* clean up */
     LLVMDisposeBuilder(build_res);  
     
@@ -870,7 +1711,7 @@ int exec_ident(jit_t * jit, ast_t * ast)
     if (ast->tag == AST_SLOT) /* deal specially with slots */
         return exec_slot(jit, ast);
 
-    bind_t * bind = ast->bind;
+    bind_t * bind = AST_BIND(ast);
 
     if (bind->val != NULL) /* we've already got a value and thus a type */
          ast->type = bind->type;
@@ -884,26 +1725,34 @@ int exec_ident(jit_t * jit, ast_t * ast)
     {
         LLVMTypeRef str_ty = arr_type(jit, ast->type);
         LLVMValueRef val = LLVMBuildGCMalloc(jit, str_ty, "tuple_s", 0);
+        LLVMValueRef len;
+
+        /* the length the array was given, see exec_array */
+        if (jit->program != NULL)
+            len = LLVMBuildLoad2(jit->builder, LLVMWordType(),
+                    llvm_import(jit, jit->lengths[ast->type->arity - 1]), "length");
+        else
+            len = LLVMConstInt(LLVMWordType(), (long) ast->type->arity, 0);
 
         /* insert length into array struct */
         LLVMValueRef indices[2] = { LLVMConstInt(LLVMInt32Type(), 0, 0), LLVMConstInt(LLVMInt32Type(), 1, 0) };
         LLVMValueRef entry = LLVMBuildInBoundsGEP(jit->builder, val, indices, 2, "length");
-        LLVMBuildStore(jit->builder, LLVMConstInt(LLVMWordType(), ast->type->arity, 0), entry);
+        LLVMBuildStore(jit->builder, len, entry);
     
         /* create array */
         int atomic = is_atomic(ast->type->ret);
-        LLVMValueRef arr = LLVMBuildGCArrayMalloc(jit, type_to_llvm(jit, ast->type->ret), LLVMConstInt(LLVMWordType(), (long) ast->type->arity, 0), "array", atomic);
+        LLVMValueRef arr = LLVMBuildGCArrayMalloc(jit, type_to_llvm(jit, ast->type->ret), len, "array", atomic);
 
         LLVMValueRef indices2[2] = { LLVMConstInt(LLVMInt32Type(), 0, 0), LLVMConstInt(LLVMInt32Type(), 0, 0) };
         entry = LLVMBuildInBoundsGEP(jit->builder, val, indices2, 2, "arr");
         LLVMBuildStore(jit->builder, arr, entry);
         
         ast->type->arity = 0;
-        ast->bind->initialised = 0;
+        AST_BIND(ast)->initialised = 0;
 
         exec_place(jit, ast);
-        LLVMBuildStore(jit->builder, val, ast->val);
-        ast->bind->initialised = 1;
+        LLVMBuildStore(jit->builder, val, AST_VAL(ast));
+        AST_BIND(ast)->initialised = 1;
     }
 
     /* if the id is a datatype constructor we do nothing */
@@ -911,13 +1760,13 @@ int exec_ident(jit_t * jit, ast_t * ast)
         return 0;
     /* if it's not an LLVM function just load the value */
     else if ((ast->type->typ != FN && ast->type->typ != LAMBDA) || bind->ast == NULL)
-        ast->val = LLVMBuildLoad(jit->builder, bind->val, bind->sym->name);
+        AST_VAL(ast) = LLVMBuildLoad(jit->builder, llvm_import(jit, bind->val), bind->sym->name);
     else if (bind->val != NULL) /* if the function has been jit'd, load that */
-        ast->val = bind->val;
+        AST_VAL(ast) = llvm_import(jit, bind->val);
     else if (ast->type->typ == FN || ast->type->typ == LAMBDA)/* jit the fn, update the binding and load it */
     {
         exec_fndef(jit, bind->ast);
-        ast->val = bind->val;
+        AST_VAL(ast) = llvm_import(jit, bind->val);
     }
     
     return 0;
@@ -928,7 +1777,7 @@ int exec_ident(jit_t * jit, ast_t * ast)
 */
 int exec_decl(jit_t * jit, ast_t * ast)
 {
-    bind_t * bind = ast->bind;
+    bind_t * bind = AST_BIND(ast);
     
     subst_type(&bind->type); /* fill in the type */
     
@@ -936,16 +1785,19 @@ int exec_decl(jit_t * jit, ast_t * ast)
     {
         LLVMTypeRef type = type_to_llvm(jit, bind->type); /* convert to llvm type */
         
-        if (scope_is_global(bind)) /* variable is global */
-        {
-            bind->val = LLVMAddGlobal(jit->module, type, bind->sym->name);
-            LLVMSetInitializer(bind->val, LLVMGetUndef(type));
-        } else /* variable is local */
+        if (!scope_is_global(bind)) /* variable is local */
             bind->val = LLVMBuildAlloca(jit->builder, type, bind->sym->name);
+        else if (jit->script) /* global, lives as long as the script */
+        {
+            bind->val = LLVMAddGlobal(jit->decls, type, bind->sym->name);
+            LLVMValueRef global = LLVMAddGlobal(jit->module, type, LLVMGetValueName(bind->val));
+            LLVMSetInitializer(global, LLVMGetUndef(type));
+        } else /* global, in a module of its own so it can be reclaimed */
+            bind->val = llvm_add_global(jit, bind->sym->name, LLVMGetUndef(type), 0, &bind->rt);
     }
 
     ast->type = bind->type;
-    ast->val = bind->val;
+    AST_VAL(ast) = llvm_import(jit, bind->val);
    
     return 0;
 }
@@ -972,7 +1824,7 @@ int exec_lslot(jit_t * jit, ast_t * ast)
     
     /* get slot from datatype */
     LLVMValueRef indices[2] = { LLVMConstInt(LLVMInt32Type(), 0, 0), LLVMConstInt(LLVMInt32Type(), i, 0) };
-    ast->val = LLVMBuildInBoundsGEP(jit->builder, id->val, indices, 2, p->sym->name);
+    AST_VAL(ast) = LLVMBuildInBoundsGEP(jit->builder, AST_VAL(id), indices, 2, p->sym->name);
     
     ast->type = id->type->param[i];
     
@@ -996,12 +1848,12 @@ int exec_llocation(jit_t * jit, ast_t * ast)
     
     /* get array from datatype */
     LLVMValueRef indices[2] = { LLVMConstInt(LLVMInt32Type(), 0, 0), LLVMConstInt(LLVMInt32Type(), 0, 0) };
-    ast->val = LLVMBuildInBoundsGEP(jit->builder, id->val, indices, 2, "arr");
-    ast->val = LLVMBuildLoad(jit->builder, ast->val, "array");
+    AST_VAL(ast) = LLVMBuildInBoundsGEP(jit->builder, AST_VAL(id), indices, 2, "arr");
+    AST_VAL(ast) = LLVMBuildLoad(jit->builder, AST_VAL(ast), "array");
     
     /* get location within array */
-    LLVMValueRef indices2[1] = { p->val };
-    ast->val = LLVMBuildInBoundsGEP(jit->builder, ast->val, indices2, 1, "arr_entry");
+    LLVMValueRef indices2[1] = { AST_VAL(p) };
+    AST_VAL(ast) = LLVMBuildInBoundsGEP(jit->builder, AST_VAL(ast), indices2, 1, "arr_entry");
     
     ast->type = id->type->ret;
     
@@ -1019,9 +1871,9 @@ int exec_place(jit_t * jit, ast_t * ast)
     if (ast->tag == AST_LOCATION) /* deal specially with array locations */
         return exec_llocation(jit, ast);
     
-    if (ast->val == NULL) /* we haven't already loaded it */
+    if (AST_VAL(ast) == NULL) /* we haven't already loaded it */
     {
-        bind_t * bind = ast->bind;
+        bind_t * bind = AST_BIND(ast);
 
         subst_type(&bind->type); /* fill in the type */
         
@@ -1032,7 +1884,7 @@ int exec_place(jit_t * jit, ast_t * ast)
             exec_decl(jit, ast);
         
         ast->type = bind->type; /* load particulars from binding */
-        ast->val = bind->val;
+        AST_VAL(ast) = llvm_import(jit, bind->val);
     }
 
     return 0;
@@ -1042,7 +1894,7 @@ int exec_assign_id(jit_t * jit, ast_t * id, type_t * type, LLVMValueRef val)
 {
     int allocated = 0;
 
-    if (id->val != NULL) 
+    if (AST_VAL(id) != NULL) 
         allocated = 1; /* lambda struct has already been allocated */
     
     /* get place */
@@ -1051,27 +1903,29 @@ int exec_assign_id(jit_t * jit, ast_t * id, type_t * type, LLVMValueRef val)
     /* convert function to lambda */
     if (id->type->typ == LAMBDA && type->typ == FN)
     {
-        id->val = make_fn_lambda(jit, val, lambda_fn_type(jit, id->type));
+        AST_VAL(id) = make_fn_lambda(jit, val, lambda_fn_type(jit, id->type));
         
         /* malloc space for lambda struct */
         if (!allocated) /* if we didn't already allocate the struct for dest */
         {
-            fn_to_lambda(jit, &id->type, &id->val, NULL, NULL);
+            fn_to_lambda(jit, &id->type, &AST_VAL(id), NULL, NULL);
             
             /* place allocated struct into struct pointer */
             bind_t * bind = find_symbol(id->sym);
-            LLVMBuildStore(jit->builder, id->val, bind->val);
+            LLVMBuildStore(jit->builder, AST_VAL(id), llvm_import(jit, bind->val));
         } else
         {
             /* get lambda struct */
-            LLVMValueRef str = LLVMBuildLoad(jit->builder, id->val, "lambda_s");
-            fn_to_lambda(jit, &id->type, &id->val, NULL, str);
+            LLVMValueRef str = LLVMBuildLoad(jit->builder, AST_VAL(id), "lambda_s");
+            fn_to_lambda(jit, &id->type, &AST_VAL(id), NULL, str);
         }
     } else /* just do the store */
-        LLVMBuildStore(jit->builder, val, id->val);
+        LLVMBuildStore(jit->builder, val, AST_VAL(id));
     
-    if (id->bind != NULL) /* slots don't have a bind */
-        id->bind->initialised = 1; /* mark it as initialised */
+    if (AST_BIND(id) != NULL) /* slots don't have a bind */
+        AST_BIND(id)->initialised = 1; /* mark it as initialised */
+
+    return 0;
 }
 
 int exec_assign_tuple(jit_t * jit, ast_t * t1, type_t * type, LLVMValueRef val)
@@ -1110,7 +1964,7 @@ int exec_assignment(jit_t * jit, ast_t * ast)
     
     if (expr->type->typ == ARRAY && expr->type->arity != 0)
     {
-        bind_t * bind = id->bind;
+        bind_t * bind = AST_BIND(id);
         subst_type(&bind->type); /* fill in the type if known */
         
         id->type = bind->type; /* load particulars from binding */
@@ -1122,11 +1976,11 @@ int exec_assignment(jit_t * jit, ast_t * ast)
     }
 
     if (id->tag != AST_LTUPLE)
-        exec_assign_id(jit, id, expr->type, expr->val);
+        exec_assign_id(jit, id, expr->type, AST_VAL(expr));
     else
-        exec_assign_tuple(jit, id, expr->type, expr->val);
+        exec_assign_tuple(jit, id, expr->type, AST_VAL(expr));
     
-    ast->val = expr->val;
+    AST_VAL(ast) = AST_VAL(expr);
     ast->type = expr->type;
     
     return 0;
@@ -1139,7 +1993,7 @@ int exec_varassign_id(jit_t * jit, ast_t * id)
     {
         LLVMValueRef index[2] = { LLVMConstInt(LLVMInt32Type(), 0, 0), bind->val };
         bind->val = LLVMBuildInBoundsGEP(jit->builder, jit->env, index, 2, "env");
-        id->val = bind->val;
+        AST_VAL(id) = bind->val;
         id->type = bind->type;
     } 
 
@@ -1181,7 +2035,7 @@ int exec_varassign(jit_t * jit, ast_t * ast)
             {
                 LLVMValueRef index[2] = { LLVMConstInt(LLVMInt32Type(), 0, 0), bind->val };
                 bind->val = LLVMBuildInBoundsGEP(jit->builder, jit->env, index, 2, "env");
-                p->val = bind->val;
+                AST_VAL(p) = bind->val;
                 p->type = bind->type;
             } else
                exec_decl(jit, p);
@@ -1223,7 +2077,7 @@ int exec_if(jit_t * jit, ast_t * ast)
     
     exec_ast(jit, exp); /* expression */
     
-    LLVMBuildCondBr(jit->builder, exp->val, b, e);
+    LLVMBuildCondBr(jit->builder, AST_VAL(exp), b, e);
     LLVMPositionBuilderAtEnd(jit->builder, b); 
    
     exit1 = exec_ast(jit, con); /* stmt1 */
@@ -1256,7 +2110,7 @@ int exec_ifelse(jit_t * jit, ast_t * ast)
     
     exec_ast(jit, exp); /* expression */
     
-    LLVMBuildCondBr(jit->builder, exp->val, b1, b2);
+    LLVMBuildCondBr(jit->builder, AST_VAL(exp), b1, b2);
     LLVMPositionBuilderAtEnd(jit->builder, b1); 
    
     exit1 = exec_ast(jit, con); /* stmt1 */
@@ -1304,24 +2158,24 @@ int exec_ifexpr(jit_t * jit, ast_t * ast)
     subst_type(&ast->type);
     LLVMValueRef val = LLVMBuildAlloca(jit->builder, type_to_llvm(jit, ast->type), "ifexpr");
     
-    LLVMBuildCondBr(jit->builder, exp->val, b1, b2);
+    LLVMBuildCondBr(jit->builder, AST_VAL(exp), b1, b2);
     LLVMPositionBuilderAtEnd(jit->builder, b1); 
    
     exec_ast(jit, con); /* stmt1 */
-    LLVMBuildStore(jit->builder, con->val, val);
+    LLVMBuildStore(jit->builder, AST_VAL(con), val);
 
     LLVMBuildBr(jit->builder, e);
 
     LLVMPositionBuilderAtEnd(jit->builder, b2);  
 
     exec_ast(jit, alt); /* stmt2 */
-    LLVMBuildStore(jit->builder, alt->val, val);
+    LLVMBuildStore(jit->builder, AST_VAL(alt), val);
 
     LLVMBuildBr(jit->builder, e);
 
     LLVMPositionBuilderAtEnd(jit->builder, e); 
     
-    ast->val = LLVMBuildLoad(jit->builder, val, "val");
+    AST_VAL(ast) = LLVMBuildLoad(jit->builder, val, "val");
       
     return 0;
 }
@@ -1332,7 +2186,7 @@ int exec_ifexpr(jit_t * jit, ast_t * ast)
 int exec_block(jit_t * jit, ast_t * ast)
 {
     ast_t * c = ast->child;
-    current_scope = ast->env;
+    scope_enter(AST_ENV(ast));
     int exit1;
 
     while (c != NULL)
@@ -1366,7 +2220,7 @@ int exec_while(jit_t * jit, ast_t * ast)
     
     exec_ast(jit, exp); /* expression */
     
-    LLVMBuildCondBr(jit->builder, exp->val, b, e);
+    LLVMBuildCondBr(jit->builder, AST_VAL(exp), b, e);
     LLVMPositionBuilderAtEnd(jit->builder, b); 
    
     jit->breakto = e;
@@ -1408,11 +2262,11 @@ int exec_return(jit_t * jit, ast_t * ast)
         exec_ast(jit, p);
         if (p->type->typ == FN) /* convert to lambda */
         {
-            p->val = make_fn_lambda(jit, p->val, lambda_fn_type(jit, p->type));
-            fn_to_lambda(jit, &p->type, &p->val, NULL, NULL);
+            AST_VAL(p) = make_fn_lambda(jit, AST_VAL(p), lambda_fn_type(jit, p->type));
+            fn_to_lambda(jit, &p->type, &AST_VAL(p), NULL, NULL);
         }
         
-        LLVMBuildRet(jit->builder, p->val);
+        LLVMBuildRet(jit->builder, AST_VAL(p));
         
     } else
         LLVMBuildRetVoid(jit->builder);
@@ -1420,33 +2274,52 @@ int exec_return(jit_t * jit, ast_t * ast)
     return 1;
 }
 
-/* recursively fill in an ast with inferred types */
+/* fill in an ast with inferred types */
 void fill_in_types(ast_t * ast)
 {
-    if (ast->env != NULL)
-        current_scope = ast->env;
+    int base = walk_len;
+    walk_t w;
+
+    walk_push(ast, WALK_LIST);
+
+    while (walk_len > base)
+    {
+        w = walk_stack[--walk_len];
+        ast = w.ast;
+
+        if (w.op == WALK_SCOPE_DOWN)
+        {
+            scope_down();
+            continue;
+        }
+
+        if (AST_ENV(ast) != NULL)
+            scope_enter(AST_ENV(ast));
     
-    if (ast->type != NULL) /* slots for example don't have types */
-        subst_type(&ast->type); /* fill in the type at this level*/
+        if (ast->type != NULL) /* slots for example don't have types */
+            subst_type(&ast->type); /* fill in the type at this level*/
     
-    if (ast->tag == AST_IDENT) /* update identifier binding */
-    {
-        bind_t * bind = find_symbol(ast->sym);
-        
-        if (bind != NULL) /* slots for example don't have types */
+        if (ast->tag == AST_IDENT) /* update identifier binding */
         {
-            if (bind->type->typ == TYPEVAR) /* we don't know what type it is */
-                subst_type(&bind->type); /* fill in the type */
+            bind_t * bind = find_symbol(ast->sym);
+        
+            if (bind != NULL) /* slots for example don't have types */
+            {
+                if (bind->type->typ == TYPEVAR) /* we don't know what type it is */
+                    subst_type(&bind->type); /* fill in the type */
+            }
         }
-    }
-    if (ast->child != NULL) /* depth first */
-        fill_in_types(ast->child);
 
-    if (ast->env != NULL)
-        scope_down();
+        /* pushed in reverse: depth first, then leave scope, then breadth */
+        if (ast->next != NULL)
+            walk_push(ast->next, WALK_LIST);
+        
+        if (AST_ENV(ast) != NULL)
+            walk_push(ast, WALK_SCOPE_DOWN);
 
-    if (ast->next != NULL) /* then breadth */
-        fill_in_types(ast->next);
+        if (ast->child != NULL)
+            walk_push(ast->child, WALK_LIST);
+    }
 }
 
 /*
@@ -1473,13 +2346,13 @@ int exec_fnparams(jit_t * jit, ast_t * ast)
                LLVMBuildStore(jit->builder, param, palloca);
         
                bind->val = palloca;
-               p->val = palloca;
+               AST_VAL(p) = palloca;
             } else /* param is in an env */
             {
                LLVMValueRef index[2] = { LLVMConstInt(LLVMInt32Type(), 0, 0), bind->val };
                bind->val = LLVMBuildInBoundsGEP(jit->builder, jit->env, index, 2, "env");
                LLVMBuildStore(jit->builder, param, bind->val);
-               p->val = bind->val;
+               AST_VAL(p) = bind->val;
             }
 
             i++;
@@ -1525,13 +2398,13 @@ int exec_lambdaparams(jit_t * jit, ast_t * ast)
             LLVMValueRef val = LLVMBuildStore(jit->builder, param, palloca);
             
             bind->val = palloca;
-            p->val = palloca;
+            AST_VAL(p) = palloca;
         } else /* param is in an env */
         {
             LLVMValueRef index[2] = { LLVMConstInt(LLVMInt32Type(), 0, 0), bind->val };
             bind->val = LLVMBuildInBoundsGEP(jit->builder, jit->env, index, 2, "env");
             LLVMBuildStore(jit->builder, param, bind->val);
-            p->val = bind->val;
+            AST_VAL(p) = bind->val;
         }
         
         i++;
@@ -1547,6 +2420,10 @@ int exec_lambdaparams(jit_t * jit, ast_t * ast)
 int exec_fndec(jit_t * jit, ast_t * ast)
 {
     fill_in_types(ast); /* just fill in all the types we've inferred */
+    
+    /* if the type is already fully known freeze it in the binding */
+    bind_t * bind = find_symbol(ast->child->sym);
+    subst_type(&bind->type);
       
     return 0;
 }
@@ -1574,13 +2451,13 @@ int exec_fndef(jit_t * jit, ast_t * ast)
     int bind_num_save = jit->bind_num;
     LLVMTypeRef env_s_save = jit->env_s;
     LLVMValueRef env_save = jit->env;
-    jit->bind_arr = ast->bind_arr;
-    jit->bind_num = ast->bind_num;
+    jit->bind_arr = AST_ENV(ast)->bind_arr;
+    jit->bind_num = AST_ENV(ast)->bind_num;
 
     make_env_s(jit); /* make environment struct */
           
     /* get argument types */
-    LLVMTypeRef * args = (LLVMTypeRef *) GC_MALLOC(params*sizeof(LLVMTypeRef));
+    LLVMTypeRef * args = (LLVMTypeRef *) arena_alloc(params*sizeof(LLVMTypeRef));
     for (i = 0; i < params; i++)
     {
         subst_type(&ast->type->param[i]);
@@ -1591,14 +2468,40 @@ int exec_fndef(jit_t * jit, ast_t * ast)
     subst_type(&ast->type->ret);
     LLVMTypeRef ret = type_to_llvm(jit, ast->type->ret); 
     
+    /* 
+       the type is fixed from here on, so freeze it: later statements 
+       see the canonical type and never touch the typevars of the body
+    */
+    subst_type(&ast->type);
+
     /* make LLVM function type */
     LLVMTypeRef fn_type = LLVMFunctionType(ret, args, params, 0);
     
-    /* make llvm function object */
+    /* 
+       make llvm function object, in a module of its own, it is jit'd
+       at tier 0 and called through a trampoline (see llvm_tier0). A
+       call stays in the code it started in, so a function with a loop
+       is optimised straight away, as is everything at -O0.
+    */
     char * fn_name = fn->sym->name;
     LLVMValueRef fn_save = jit->function;
-    jit->function = LLVMAddFunction(jit->module, fn_name, fn_type);
-    ast->val = jit->function;
+    LLVMModuleRef module_save = llvm_module_begin(jit, fn_name);
+    LLVMValueRef tramp = llvm_add_function(jit, fn_name, fn_type);
+    LLVMValueRef tick = NULL;
+    jit->function = tramp;
+    if (jit->level > 0 && jit->program == NULL && !has_loop(fn->next->next->child))
+    {
+        char * name = (char *) arena_alloc(strlen(LLVMGetValueName(tramp)) + 6);
+        sprintf(name, "%s.t0", LLVMGetValueName(tramp));
+        jit->function = LLVMAddFunction(jit->module, name, fn_type);
+        LLVMSetLinkage(jit->function, LLVMInternalLinkage);
+
+        /* counts calls, given a body by llvm_tier0 */
+        sprintf(name, "%s.tick", LLVMGetValueName(tramp));
+        tick = LLVMAddFunction(jit->module, name, 
+                          LLVMFunctionType(LLVMVoidType(), NULL, 0, 0));
+    }
+    AST_VAL(ast) = jit->function;
 
     type_t * t;
     /* set nocapture on all structured params */
@@ -1606,21 +2509,16 @@ int exec_fndef(jit_t * jit, ast_t * ast)
     {
         t = ast->type->param[i];
         if (t->typ == ARRAY || t->typ == TUPLE || t->typ == DATATYPE)
-            LLVMAddAttribute(LLVMGetParam(ast->val, i), LLVMNoCaptureAttribute);
+            LLVMAddAttributeAtIndex(AST_VAL(ast), i + 1, llvm_attr("nocapture"));
     }
     
-    /* set nocapture on all structured return values */
-    t = ast->type->ret;
-    if (t->typ == ARRAY || t->typ == TUPLE || t->typ == DATATYPE)
-        LLVMAddFunctionAttr(ast->val, LLVMNoAliasAttribute);
- 
     /* add the prototype to the symbol binding in case the function calls itself */
     bind_t * bind = find_symbol(fn->sym);
-    bind->val = jit->function;
+    bind->val = LLVMGetNamedFunction(jit->decls, LLVMGetValueName(tramp));
     bind->type = ast->type;
 
     env_t * scope_save = current_scope;
-    current_scope = ast->env;
+    scope_enter(AST_ENV(ast));
 
     /* jit setup */
     LLVMBuilderRef build_save = jit->builder;
@@ -1629,6 +2527,8 @@ int exec_fndef(jit_t * jit, ast_t * ast)
     /* first basic block */
     LLVMBasicBlockRef entry = LLVMAppendBasicBlock(jit->function, "entry");
     LLVMPositionBuilderAtEnd(jit->builder, entry);
+    if (tick != NULL)
+        LLVMBuildCall2(jit->builder, LLVMGlobalGetValueType(tick), tick, NULL, 0, "");
        
     /* make environment malloc */
     if (jit->bind_num != 0)
@@ -1645,14 +2545,18 @@ int exec_fndef(jit_t * jit, ast_t * ast)
         p = p->next;
     }
             
-    /* run the pass manager on the jit'd function */
-    LLVMRunFunctionPassManager(jit->pass, jit->function); 
-    
+    /* callers link to the function, it is removed once none can */
+    bind->rt = LLVMOrcJITDylibCreateResourceTracker(jit->dylib);
+    if (tick != NULL)
+        llvm_tier0(jit, tramp, jit->function, tick, bind->rt);
+    llvm_module_end(jit, module_save, bind->rt, tick == NULL);
+    AST_VAL(ast) = bind->val;
+
     /* clean up */
     LLVMDisposeBuilder(jit->builder);  
     jit->builder = build_save;
     jit->function = fn_save;    
-    current_scope = scope_save;
+    scope_enter(scope_save);
 
     jit->bind_arr = bind_arr_save;
     jit->bind_num = bind_num_save;
@@ -1674,7 +2578,7 @@ int exec_lambda(jit_t * jit, ast_t * ast)
     LLVMValueRef env_save = jit->env;
       
     /* get argument types */
-    LLVMTypeRef * args = (LLVMTypeRef *) GC_MALLOC((params + 1)*sizeof(LLVMTypeRef));
+    LLVMTypeRef * args = (LLVMTypeRef *) arena_alloc((params + 1)*sizeof(LLVMTypeRef));
     for (i = 0; i < params; i++)
     {
         subst_type(&ast->type->param[i]);
@@ -1689,10 +2593,11 @@ int exec_lambda(jit_t * jit, ast_t * ast)
     /* make LLVM function type */
     LLVMTypeRef fn_type = LLVMFunctionType(ret, args, params + 1, 0);
     
-    /* make llvm function object */
+    /* make llvm function object, only ever called through a lambda struct */
     LLVMValueRef fn_save = jit->function;
     jit->function = LLVMAddFunction(jit->module, "lambda", fn_type);
-    ast->val = jit->function;
+    LLVMSetLinkage(jit->function, LLVMInternalLinkage);
+    AST_VAL(ast) = jit->function;
 
     /* add the prototype to the symbol binding */
     bind_t * bind = find_symbol(sym_lookup("lambda"));
@@ -1700,7 +2605,7 @@ int exec_lambda(jit_t * jit, ast_t * ast)
     bind->type = ast->type;
 
     env_t * scope_save = current_scope;
-    current_scope = ast->env;
+    scope_enter(AST_ENV(ast));
 
     /* jit setup */
     LLVMBuilderRef build_save = jit->builder;
@@ -1714,7 +2619,7 @@ int exec_lambda(jit_t * jit, ast_t * ast)
     exec_lambdaparams(jit, ast->child);
     
     /* back up bindings in bind array and set them to environment entries */
-    LLVMValueRef * bind_save = (LLVMValueRef *) GC_MALLOC(jit->bind_num*sizeof(LLVMValueRef));
+    LLVMValueRef * bind_save = (LLVMValueRef *) arena_alloc(jit->bind_num*sizeof(LLVMValueRef));
     for (i = 0; i < jit->bind_num; i++)
     {
         bind_save[i] = jit->bind_arr[i]->val;
@@ -1736,16 +2641,13 @@ int exec_lambda(jit_t * jit, ast_t * ast)
     exec_ast(jit, p);
     if (p->type->typ == FN) /* convert to lambda */
     {
-        p->val = make_fn_lambda(jit, p->val, lambda_fn_type(jit, p->type));
-        fn_to_lambda(jit, &p->type, &p->val, NULL, NULL);
+        AST_VAL(p) = make_fn_lambda(jit, AST_VAL(p), lambda_fn_type(jit, p->type));
+        fn_to_lambda(jit, &p->type, &AST_VAL(p), NULL, NULL);
     }
 
     /* jit return */
-    LLVMBuildRet(jit->builder, p->val);
+    LLVMBuildRet(jit->builder, AST_VAL(p));
 
-    /* run the pass manager on the jit'd function */
-    LLVMRunFunctionPassManager(jit->pass, jit->function); 
-    
     /* restore original values in bind array */
     for (i = 0; i < jit->bind_num; i++)
         jit->bind_arr[i]->val = bind_save[i];
@@ -1755,7 +2657,7 @@ int exec_lambda(jit_t * jit, ast_t * ast)
     LLVMDisposeBuilder(jit->builder);  
     jit->builder = build_save;
     jit->function = fn_save;    
-    current_scope = scope_save;
+    scope_enter(scope_save);
     
     if (jit->bind_num == 0) /* no environment required */
         fn_to_lambda(jit, &bind->type, &bind->val, NULL, NULL);
@@ -1764,7 +2666,7 @@ int exec_lambda(jit_t * jit, ast_t * ast)
            LLVMBuildPointerCast(jit->builder, jit->env, 
               LLVMPointerType(LLVMInt8Type(), 0), "env"), NULL);
  
-    ast->val = bind->val;
+    AST_VAL(ast) = bind->val;
     
     return 0;
 }
@@ -1820,14 +2722,14 @@ int exec_typeconstr(jit_t * jit, ast_t * ast, LLVMValueRef * args)
     for (i = 0; i < params; i++)
         atomic &= is_atomic(id->type->param[i]);
 
-    ast->val = LLVMBuildGCMalloc(jit, str_ty, id->sym->name, atomic);
+    AST_VAL(ast) = LLVMBuildGCMalloc(jit, str_ty, id->sym->name, atomic);
     ast->type = id->type;
     
     for (i = 0; i < params; i++)
     {
         /* insert value into datatype */
         LLVMValueRef indices[2] = { LLVMConstInt(LLVMInt32Type(), 0, 0), LLVMConstInt(LLVMInt32Type(), i, 0) };
-        LLVMValueRef entry = LLVMBuildInBoundsGEP(jit->builder, ast->val, indices, 2, id->sym->name);
+        LLVMValueRef entry = LLVMBuildInBoundsGEP(jit->builder, AST_VAL(ast), indices, 2, id->sym->name);
         LLVMBuildStore(jit->builder, args[i], entry);
     }
    
@@ -1856,8 +2758,8 @@ int exec_slot(jit_t * jit, ast_t * ast)
     
     /* get slot from datatype */
     LLVMValueRef indices[2] = { LLVMConstInt(LLVMInt32Type(), 0, 0), LLVMConstInt(LLVMInt32Type(), i, 0) };
-    LLVMValueRef entry = LLVMBuildInBoundsGEP(jit->builder, id->val, indices, 2, p->sym->name);
-    ast->val = LLVMBuildLoad(jit->builder, entry, p->sym->name);
+    LLVMValueRef entry = LLVMBuildInBoundsGEP(jit->builder, AST_VAL(id), indices, 2, p->sym->name);
+    AST_VAL(ast) = LLVMBuildLoad(jit->builder, entry, p->sym->name);
     
     ast->type = id->type->param[i];
    
@@ -1881,15 +2783,15 @@ int exec_location(jit_t * jit, ast_t * ast)
     
     /* get array from datatype */
     LLVMValueRef indices[2] = { LLVMConstInt(LLVMInt32Type(), 0, 0), LLVMConstInt(LLVMInt32Type(), 0, 0) };
-    ast->val = LLVMBuildInBoundsGEP(jit->builder, id->val, indices, 2, "arr");
-    ast->val = LLVMBuildLoad(jit->builder, ast->val, "array");
+    AST_VAL(ast) = LLVMBuildInBoundsGEP(jit->builder, AST_VAL(id), indices, 2, "arr");
+    AST_VAL(ast) = LLVMBuildLoad(jit->builder, AST_VAL(ast), "array");
     
     /* get location within array */
-    LLVMValueRef indices2[1] = { p->val };
-    ast->val = LLVMBuildInBoundsGEP(jit->builder, ast->val, indices2, 1, "arr_entry");
+    LLVMValueRef indices2[1] = { AST_VAL(p) };
+    AST_VAL(ast) = LLVMBuildInBoundsGEP(jit->builder, AST_VAL(ast), indices2, 1, "arr_entry");
     
     /* load value */
-    ast->val = LLVMBuildLoad(jit->builder, ast->val, "entry");
+    AST_VAL(ast) = LLVMBuildLoad(jit->builder, AST_VAL(ast), "entry");
     
     ast->type = id->type->ret;
    
@@ -1910,7 +2812,7 @@ int exec_appl(jit_t * jit, ast_t * ast)
     
     params = fn->type->arity;
     LLVMValueRef * args = (LLVMValueRef *) /* one extra for env if lambda */
-        GC_MALLOC((params + (fn->type->typ == LAMBDA))*sizeof(LLVMValueRef));
+        arena_alloc((params + (fn->type->typ == LAMBDA))*sizeof(LLVMValueRef));
     
     /* jit function arguments */
     p = fn->next;
@@ -1920,23 +2822,23 @@ int exec_appl(jit_t * jit, ast_t * ast)
         
         if (p->type->typ == FN) /* convert function to lambda */
         {
-            p->val = make_fn_lambda(jit, p->val, lambda_fn_type(jit, p->type));
-            fn_to_lambda(jit, &p->type, &p->val, NULL, NULL);
+            AST_VAL(p) = make_fn_lambda(jit, AST_VAL(p), lambda_fn_type(jit, p->type));
+            fn_to_lambda(jit, &p->type, &AST_VAL(p), NULL, NULL);
         }
 
-        args[i] = p->val;
+        args[i] = AST_VAL(p);
         p = p->next;
     }
     
     /* call function */
     if (fn->type->typ == FN)
-        ast->val = LLVMBuildCall(jit->builder, fn->val, args, params, "");
+        AST_VAL(ast) = LLVMBuildCall(jit->builder, AST_VAL(fn), args, params, "");
     else if (fn->type->typ == DATATYPE)
         return exec_typeconstr(jit, ast, args);
     else /* lambda */
     {
         /* load struct */
-        LLVMValueRef str = fn->val;
+        LLVMValueRef str = AST_VAL(fn);
 
         /* load function entry */
         LLVMValueRef indices[2] = { LLVMConstInt(LLVMInt32Type(), 0, 0), LLVMConstInt(LLVMInt32Type(), 0, 0) };
@@ -1950,7 +2852,7 @@ int exec_appl(jit_t * jit, ast_t * ast)
         args[i] = env;
 
         /* call function */
-        ast->val = LLVMBuildCall(jit->builder, function, args, params + 1, "");
+        AST_VAL(ast) = LLVMBuildCall(jit->builder, function, args, params + 1, "");
     }
 
     /* update return type */
@@ -1970,33 +2872,60 @@ int exec_array(jit_t * jit, ast_t * ast)
 
     ast_t * p = ast->child;
     
-    /* for global arrays whose type is not known just jit the length */
+    /* 
+       for global arrays whose type is not known just jit the length,
+       the array is made once the type is known, see exec_ident
+    */
     if (ast->type->ret->typ == TYPEVAR && current_scope->next == NULL)
     {
         subst_type(&p->type);
+        
+        /* 
+           ahead of time the length is only known once the program runs,
+           so it is stored in a global, and arity is one more than the 
+           index of the global in jit->lengths instead of the length
+        */
+        if (jit->program != NULL)
+        {
+            LLVMValueRef len = llvm_add_global(jit, "length", 
+                                   LLVMConstInt(LLVMWordType(), 0, 0), 0, NULL);
+            exec_ast(jit, p);
+            LLVMBuildStore(jit->builder, AST_VAL(p), llvm_import(jit, len));
+            
+            if (jit->num_lengths == 0) /* do first allocation */
+                jit->lengths = (LLVMValueRef *) GC_MALLOC(sizeof(LLVMValueRef));
+            else if ((jit->num_lengths & (jit->num_lengths - 1)) == 0) /* realloc if power of 2 */
+                jit->lengths = (LLVMValueRef *) GC_REALLOC(jit->lengths, 
+                                         (jit->num_lengths << 1)*sizeof(LLVMValueRef));
+            jit->lengths[jit->num_lengths++] = len;
+            
+            ast->type->arity = jit->num_lengths;
+            return 0;
+        }
+
         long r;
-        START_EXEC;
+        START_INT_EXEC;
         exec_ast(jit, p);
-        INT_EXEC(r, p->val);
+        INT_EXEC(r, AST_VAL(p));
         ast->type->arity = (int) r;
         return 0;
     } else
         exec_ast(jit, p);
 
     LLVMTypeRef str_ty = arr_type(jit, ast->type);
-    ast->val = LLVMBuildGCMalloc(jit, str_ty, "tuple_s", 0);
+    AST_VAL(ast) = LLVMBuildGCMalloc(jit, str_ty, "tuple_s", 0);
 
     /* insert length into array struct */
     LLVMValueRef indices[2] = { LLVMConstInt(LLVMInt32Type(), 0, 0), LLVMConstInt(LLVMInt32Type(), 1, 0) };
-    LLVMValueRef entry = LLVMBuildInBoundsGEP(jit->builder, ast->val, indices, 2, "length");
-    LLVMBuildStore(jit->builder, p->val, entry);
+    LLVMValueRef entry = LLVMBuildInBoundsGEP(jit->builder, AST_VAL(ast), indices, 2, "length");
+    LLVMBuildStore(jit->builder, AST_VAL(p), entry);
     
     /* create array */
     int atomic = is_atomic(ast->type->ret);
-    LLVMValueRef arr = LLVMBuildGCArrayMalloc(jit, type_to_llvm(jit, ast->type->ret), p->val, "array", atomic);
+    LLVMValueRef arr = LLVMBuildGCArrayMalloc(jit, type_to_llvm(jit, ast->type->ret), AST_VAL(p), "array", atomic);
 
     LLVMValueRef indices2[2] = { LLVMConstInt(LLVMInt32Type(), 0, 0), LLVMConstInt(LLVMInt32Type(), 0, 0) };
-    entry = LLVMBuildInBoundsGEP(jit->builder, ast->val, indices2, 2, "arr");
+    entry = LLVMBuildInBoundsGEP(jit->builder, AST_VAL(ast), indices2, 2, "arr");
     LLVMBuildStore(jit->builder, arr, entry);
     
     return 0;
@@ -2019,7 +2948,7 @@ int exec_tuple(jit_t * jit, ast_t * ast)
     for (i = 0; i < params; i++)
         atomic &= is_atomic(ast->type->param[i]);
 
-    ast->val = LLVMBuildGCMalloc(jit, str_ty, "tuple_s", atomic);
+    AST_VAL(ast) = LLVMBuildGCMalloc(jit, str_ty, "tuple_s", atomic);
 
     ast_t * p = ast->child;
     for (i = 0; i < params; i++)
@@ -2028,14 +2957,14 @@ int exec_tuple(jit_t * jit, ast_t * ast)
         
         if (p->type->typ == FN) /* convert function to lambda */
         {
-            p->val = make_fn_lambda(jit, p->val, lambda_fn_type(jit, p->type));
-            fn_to_lambda(jit, &p->type, &p->val, NULL, NULL);
+            AST_VAL(p) = make_fn_lambda(jit, AST_VAL(p), lambda_fn_type(jit, p->type));
+            fn_to_lambda(jit, &p->type, &AST_VAL(p), NULL, NULL);
         }
  
         /* insert value into tuple */
         LLVMValueRef indices[2] = { LLVMConstInt(LLVMInt32Type(), 0, 0), LLVMConstInt(LLVMInt32Type(), i, 0) };
-        LLVMValueRef entry = LLVMBuildInBoundsGEP(jit->builder, ast->val, indices, 2, "tuple");
-        LLVMBuildStore(jit->builder, p->val, entry);
+        LLVMValueRef entry = LLVMBuildInBoundsGEP(jit->builder, AST_VAL(ast), indices, 2, "tuple");
+        LLVMBuildStore(jit->builder, AST_VAL(p), entry);
     
         p = p->next;
     }
@@ -2053,7 +2982,7 @@ void make_env_s(jit_t * jit)
     
     if (num != 0)
     {
-        LLVMTypeRef * types = (LLVMTypeRef *) GC_MALLOC(num*sizeof(LLVMTypeRef));
+        LLVMTypeRef * types = (LLVMTypeRef *) arena_alloc(num*sizeof(LLVMTypeRef));
         for (i = 0; i < num; i++)
         {
             bind_t * bind = jit->bind_arr[i];
@@ -2089,49 +3018,57 @@ void add_bind(jit_t * jit, bind_t * bind)
 void collect_idents(jit_t * jit, ast_t * ast)
 {
     bind_t * bind;
-    int i;
-    int child_only = 0;
+    int i, scope;
+    int base = walk_len;
+    walk_t w;
 
-    /* check if we are entering a new scope */
-    if (ast->tag == AST_FNDEC || ast->tag == AST_LAMBDA || ast->tag == AST_BLOCK)
-        current_scope = ast->env;
+    walk_push(ast, WALK_LIST);
 
-child_process:
-    if (ast->tag == AST_IDENT)
+    while (walk_len > base)
     {
-        bind = find_symbol(ast->sym); /* only locals get put into lambda envs */
-        if (!scope_is_current(bind)) /* also ensure the identifier is from another scope */
+        w = walk_stack[--walk_len];
+        ast = w.ast;
+
+        if (w.op == WALK_SCOPE_DOWN)
         {
-            if (!scope_is_global(bind)) /* ensure the variable is local */
+            scope_down();
+            continue;
+        }
+
+        /* check if we are entering a new scope */
+        scope = (ast->tag == AST_FNDEC || ast->tag == AST_LAMBDA || ast->tag == AST_BLOCK);
+        if (scope)
+            scope_enter(AST_ENV(ast));
+
+        if (ast->tag == AST_IDENT)
+        {
+            bind = find_symbol(ast->sym); /* only locals get put into lambda envs */
+            if (!scope_is_current(bind)) /* also ensure the identifier is from another scope */
             {
-                for (i = 0; i < jit->bind_num; i++) /* see if we already have it */
-                    if (jit->bind_arr[i] == bind)
-                        break;
+                if (!scope_is_global(bind)) /* ensure the variable is local */
+                {
+                    for (i = 0; i < jit->bind_num; i++) /* see if we already have it */
+                        if (jit->bind_arr[i] == bind)
+                            break;
 
-                if (i == jit->bind_num) /* if not, add it */
-                    add_bind(jit, bind);
+                    if (i == jit->bind_num) /* if not, add it */
+                        add_bind(jit, bind);
+                }
             }
         }
-    }
-
-    if (child_only)
-        return;
-
-    if (ast->tag == AST_SLOT) /* only process the id for a slot access */
-    {
-        ast = ast->child;
-        child_only = 1;
-        goto child_process;
-    }
 
-    if (ast->child != NULL && ast->tag != AST_PARAMS) /* don't process params */
-        collect_idents(jit, ast->child); /* depth first */
+        /* pushed in reverse: depth first, then leave scope, then breadth */
+        if (w.op == WALK_LIST && ast->next != NULL)
+            walk_push(ast->next, WALK_LIST);
 
-    if (ast->tag == AST_FNDEC || ast->tag == AST_LAMBDA || ast->tag == AST_BLOCK)
-        scope_down();
+        if (scope)
+            walk_push(ast, WALK_SCOPE_DOWN);
 
-    if (ast->next != NULL)
-        collect_idents(jit, ast->next); /* then breadth */
+        if (ast->tag == AST_SLOT) /* the slot name following the id is not a variable */
+            walk_push(ast->child, WALK_NODE);
+        else if (ast->child != NULL && ast->tag != AST_PARAMS) /* don't process params */
+            walk_push(ast->child, WALK_LIST);
+    }
 }
 
 /*
@@ -2140,15 +3077,24 @@ child_process:
 */
 void process_lambdas(jit_t * jit, ast_t * ast)
 {
-    if (ast->tag == AST_LAMBDA) /* found a lambda */
-        collect_idents(jit, ast);
-    else
+    int base = walk_len;
+
+    walk_push(ast, WALK_LIST);
+
+    while (walk_len > base)
     {
-        if (ast->child != NULL)
-            process_lambdas(jit, ast->child); /* depth first */
+        ast = walk_stack[--walk_len].ast;
 
-        if (ast->next != NULL)
-            process_lambdas(jit, ast->next); /* then breadth */
+        if (ast->tag == AST_LAMBDA) /* found a lambda, this and what follows */
+            collect_idents(jit, ast);
+        else
+        {
+            if (ast->next != NULL) /* then breadth */
+                walk_push(ast->next, WALK_LIST);
+
+            if (ast->child != NULL) /* depth first */
+                walk_push(ast->child, WALK_LIST);
+        }
     }
 }
 
@@ -2280,18 +3226,18 @@ int exec_ast(jit_t * jit, ast_t * ast)
     }
 }
 
-/* We start traversing the ast to do jit'ing */
-void exec_root(jit_t * jit, ast_t * ast)
+/*
+   Jit a top level statement into the current function, leaving the
+   result printing code behind it if required
+*/
+void exec_stmt(jit_t * jit, ast_t * ast, int print)
 {
-    /* Traverse the ast jit'ing everything, then run the jit'd code */
-    START_EXEC;
-         
     process_lambdas(jit, ast); /* get any locals that need to go in an env */
     
     if (ast->tag == AST_FNDEC) /* save bind array for when function is jit'd */
     {
-        ast->bind_arr = jit->bind_arr;
-        ast->bind_num = jit->bind_num;
+        AST_ENV(ast)->bind_arr = jit->bind_arr;
+        AST_ENV(ast)->bind_num = jit->bind_num;
         jit->bind_arr = NULL;
         jit->bind_num = 0;
     } else /* otherwise make the struct and allocate it now */
@@ -2305,20 +3251,153 @@ void exec_root(jit_t * jit, ast_t * ast)
     exec_ast(jit, ast);
     
     /* print the resulting value */
-    print_obj(jit, ast->type, ast->val);
+    if (print)
+    {
+        print_obj(jit, ast->type, AST_VAL(ast));
+        
+        /* the REPL's prompt starts a new line, a script has none */
+        if (jit->script)
+           llvm_printf(jit, "\n");
+    }
+    
+    jit->bind_num = 0; /* clean up bind array */
+}
+
+/*
+   Remove the modules of shadowed global variables and functions that
+   nothing refers to any more. Only safe once the code of the statement
+   that may have used them has been run.
+*/
+void reclaim_globals(jit_t * jit)
+{
+    bind_t * b;
+
+    if (current_scope->next != NULL)
+        return;
+
+    for (b = scope_sweep(); b != NULL; b = b->next)
+    {
+        if (b->rt == NULL) /* a type, or a function whose jit'ing failed */
+            continue;
+
+        llvm_check(LLVMOrcResourceTrackerRemove(b->rt));
+        LLVMOrcReleaseResourceTracker(b->rt);
+        jit->reclaimed++;
+        jit->removed++;
+
+        if (b->ast == NULL) /* a variable */
+            LLVMDeleteGlobal(b->val); /* its name can be used again */
+        else /* a function, with its optimised code */
+        {
+            llvm_tier_drop(jit, LLVMGetValueName(b->val));
+            LLVMDeleteFunction(b->val);
+        }
+    }
+}
+
+void exec_root(jit_t * jit, ast_t * ast)
+{
+    /* Traverse the ast jit'ing everything, then run the jit'd code */
+    jit->opt = (ast->tag != AST_FNDEC && has_loop(ast));
+    START_EXEC;
+         
+    exec_stmt(jit, ast, 1);
     
     END_EXEC;
          
-    /* 
-       If our jit side print_obj had to create a format string
-       clean it up now that we've executed the jit'd code.
-    */
-    if (jit->fmt_str)
+    reclaim_globals(jit);
+}
+
+/*
+   In script mode every statement is jit'd into a single function which
+   is only run once the whole script has been read. Start that function.
+*/
+void exec_script_begin(jit_t * jit)
+{
+    jit->builder = LLVMCreateBuilder();
+    jit->script = 1;
+    jit->opt = 0;
+    llvm_module_begin(jit, "script");
+    LLVMTypeRef args[] = { };
+    LLVMTypeRef fn_type = LLVMFunctionType(LLVMVoidType(), args, 0, 0);
+    jit->function = llvm_add_function(jit, "script", fn_type);
+    LLVMBasicBlockRef entry = LLVMAppendBasicBlock(jit->function, "entry");
+    LLVMPositionBuilderAtEnd(jit->builder, entry);
+}
+
+/*
+   Finish the script function and run it, it is optimised if it has
+   any loops or lambdas
+*/
+void exec_script_end(jit_t * jit)
+{
+    LLVMOrcResourceTrackerRef rt;
+    LLVMBuildRetVoid(jit->builder);
+    if (TRACE)
+       LLVMDumpModule(jit->module);
+    if (jit->program != NULL) /* it is run by main, see llvm_emit_program */
+       llvm_module_end(jit, NULL, NULL, 0);
+    else
     {
-        LLVMDeleteGlobal(jit->fmt_str);
-        jit->fmt_str = NULL;
+       exec_fn_t script = (exec_fn_t) llvm_exec_module(jit, NULL, &rt);
+       script();
+       llvm_exec_done(jit, rt);
     }
+    LLVMDisposeBuilder(jit->builder);
+    jit->function = NULL;
+    jit->builder = NULL;
+    jit->script = 0;
+}
 
-    jit->bind_num = 0; /* clean up bind array */
+/*
+   Does the given ast contain an array constructor. The length of a global
+   array of unknown type is computed at compile time (see exec_array) so
+   anything jit'd before it must already have been run.
+*/
+int has_array(ast_t * ast)
+{
+    while (ast != NULL)
+    {
+        if (ast->tag == AST_ARRAY || has_array(ast->child))
+            return 1;
+        ast = ast->next;
+    }
+
+    return 0;
+}
+
+/*
+   Does the given ast contain a loop or a lambda, i.e. code which may 
+   be run many times. Exec functions and functions containing one are
+   optimised straight away, the rest are jit'd at tier 0.
+*/
+int has_loop(ast_t * ast)
+{
+    while (ast != NULL)
+    {
+        if (ast->tag == AST_WHILE || ast->tag == AST_LAMBDA || has_loop(ast->child))
+            return 1;
+        ast = ast->next;
+    }
+
+    return 0;
+}
+
+/*
+   Jit a statement into the script function. Results are only printed
+   if we were asked to echo them.
+*/
+void exec_script_stmt(jit_t * jit, ast_t * ast)
+{
+    if (ast->tag != AST_FNDEC && has_array(ast) && jit->program == NULL)
+    {
+        exec_script_end(jit);
+        exec_script_begin(jit);
+    }
+
+    if (ast->tag != AST_FNDEC && has_loop(ast))
+        jit->opt = 1;
+
+    exec_stmt(jit, ast, jit->echo);
 }
 
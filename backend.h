@@ -3,9 +3,10 @@
 
 #include <llvm-c/Core.h>  
 #include <llvm-c/Analysis.h>  
-#include <llvm-c/ExecutionEngine.h>  
+#include <llvm-c/LLJIT.h>  
 #include <llvm-c/Target.h>  
-#include <llvm-c/Transforms/Scalar.h> 
+#include <llvm-c/TargetMachine.h>  
+#include <llvm-c/Transforms/PassBuilder.h> 
 
 #include "ast.h"
 
@@ -22,30 +23,93 @@
 #define LLVMWordType() LLVMInt64Type()
 #endif
 
+#define TIER_UP 1000 /* calls before a function is re-optimised */
+
+#define TIER_TAB_INIT 64 /* initial buckets of jit->tiers, a power of two */
+
+/* A function jit'd at tier 0, which is re-optimised once it is hot */
+typedef struct tier_t
+{
+    struct jit_t * jit;
+    LLVMValueRef decl; /* the function's trampoline in jit->decls */
+    LLVMModuleRef module; /* unoptimised copy of its module, with no counters */
+    LLVMOrcResourceTrackerRef rt; /* removes its modules, optimised or not */
+    struct tier_t * next; /* in the same bucket of jit->tiers */
+} tier_t;
+
 typedef struct jit_t
 {
     LLVMBuilderRef builder;
     LLVMValueRef function;
-    LLVMExecutionEngineRef engine;  
-    LLVMPassManagerRef pass;
-    LLVMModuleRef module;
-    LLVMValueRef fmt_str;
-    LLVMValueRef nil_str;
-    LLVMValueRef true_str;
-    LLVMValueRef false_str;
+    LLVMOrcLLJITRef engine;  
+    LLVMOrcJITDylibRef dylib; /* where the symbols of all modules live */
+    LLVMOrcThreadSafeContextRef context;
+    const char * passes; /* pipeline hot code is optimised with */
+    LLVMPassBuilderOptionsRef options;
+    int ipo; /* inline across modules when optimising, see llvm_link_bodies */
+    LLVMTargetMachineRef machine; /* code generator for optimised code */
+    const char * cpu; /* CPU code is generated for */
+    const char * features; /* features of that CPU code may use */
+    LLVMModuleRef module; /* module we are currently jit'ing into */
+    LLVMModuleRef decls; /* declarations of everything the modules export */
+    LLVMModuleRef program; /* everything, when compiling ahead of time */
+    LLVMValueRef * lengths; /* globals holding lengths of arrays, see exec_array */
+    int num_lengths;
     LLVMBasicBlockRef breakto;
     struct bind_t ** bind_arr;
     int bind_num;
     LLVMTypeRef env_s;
     LLVMValueRef env;
+    int echo; /* print the result of each statement */
+    int script; /* statements are jit'd into one script function */
+    int level; /* optimisation level, -O0 to -O3 */
+    int opt; /* optimise the exec function we are jit'ing, it may be hot */
+    tier_t ** tiers; /* functions jit'd at tier 0 and not yet removed, by name */
+    int tier_size; /* number of buckets, a power of two */
+    int tier_count;
+    long reclaimed; /* globals and functions deleted once nothing could refer to them */
+    long modules; /* modules handed to the jit */
+    long removed; /* modules removed once nothing could refer to them */
+    long tiered; /* functions re-optimised once hot */
 } jit_t;
 
-jit_t * llvm_init(void);
+int llvm_cpu_valid(const char * cpu);
+
+jit_t * llvm_init(int level, int ipo, const char * cpu);
 
 void llvm_reset(jit_t * jit);
 
 void llvm_cleanup(jit_t * jit);
 
+void print_jit_stats(jit_t * jit);
+
+LLVMModuleRef llvm_module_begin(jit_t * jit, const char * name);
+
+void llvm_module_end(jit_t * jit, LLVMModuleRef save, 
+                               LLVMOrcResourceTrackerRef rt, int opt);
+
+void llvm_optimise(jit_t * jit, LLVMModuleRef module);
+
+void llvm_tier_up(tier_t * t);
+
+void llvm_tier_drop(jit_t * jit, const char * name);
+
+void llvm_program_begin(jit_t * jit);
+
+int llvm_emit_program(jit_t * jit, const char * path);
+
+LLVMValueRef llvm_add_function(jit_t * jit, const char * name, LLVMTypeRef type);
+
+LLVMValueRef llvm_add_global(jit_t * jit, const char * name, LLVMValueRef init, 
+                                 int constant, LLVMOrcResourceTrackerRef * rt);
+
+LLVMValueRef llvm_import(jit_t * jit, LLVMValueRef val);
+
+LLVMOrcExecutorAddress llvm_exec_module(jit_t * jit, LLVMModuleRef save, 
+                                          LLVMOrcResourceTrackerRef * rt);
+
+void llvm_exec_done(jit_t * jit, LLVMOrcResourceTrackerRef rt);
+
 LLVMTypeRef type_to_llvm(jit_t * jit, type_t * type);
 
 void print_obj(jit_t * jit, type_t * type, LLVMValueRef obj);
@@ -67,22 +131,44 @@ int exec_slot(jit_t * jit, ast_t * ast);
 
 int exec_ast(jit_t * jit, ast_t * ast);
 
+void exec_stmt(jit_t * jit, ast_t * ast, int print);
+
 void exec_root(jit_t * jit, ast_t * ast);
 
+void exec_script_begin(jit_t * jit);
+
+void exec_script_end(jit_t * jit);
+
+int has_array(ast_t * ast);
+
+int has_loop(ast_t * ast);
+
+void exec_script_stmt(jit_t * jit, ast_t * ast);
+
 void llvm_functions(jit_t * jit);
 
-/* Set things up so we can begin jit'ing */
-#define START_EXEC \
+/* native signatures of the jit'd functions statements are run with */
+typedef void (* exec_fn_t)(void);
+typedef long (* int_exec_fn_t)(void);
+
+/* Set things up so we can begin jit'ing, into a module of our own */
+#define START_EXEC START_EXEC_RET(LLVMVoidType())
+
+/* The same, for code computing an integer, see INT_EXEC */
+#define START_INT_EXEC START_EXEC_RET(LLVMWordType())
+
+#define START_EXEC_RET(ret) \
    LLVMBuilderRef __builder_save; \
    LLVMValueRef __function_save; \
+   LLVMModuleRef __module_save; \
    do { \
    __builder_save = jit->builder; \
    jit->builder = LLVMCreateBuilder(); \
    __function_save = jit->function; \
+   __module_save = llvm_module_begin(jit, "exec"); \
    LLVMTypeRef __args[] = { }; \
-   LLVMTypeRef __retval = LLVMVoidType(); \
-   LLVMTypeRef __fn_type = LLVMFunctionType(__retval, __args, 0, 0); \
-   jit->function = LLVMAddFunction(jit->module, "exec", __fn_type); \
+   LLVMTypeRef __fn_type = LLVMFunctionType(ret, __args, 0, 0); \
+   jit->function = llvm_add_function(jit, "exec", __fn_type); \
    LLVMBasicBlockRef __entry = LLVMAppendBasicBlock(jit->function, "entry"); \
    LLVMPositionBuilderAtEnd(jit->builder, __entry); \
    } while (0)
@@ -91,28 +177,27 @@ void llvm_functions(jit_t * jit);
 #define END_EXEC \
    do { \
    LLVMBuildRetVoid(jit->builder); \
-   LLVMRunFunctionPassManager(jit->pass, jit->function); \
    if (TRACE) \
       LLVMDumpModule(jit->module); \
-   LLVMGenericValueRef __exec_args[] = {}; \
-   LLVMRunFunction(jit->engine, jit->function, 0, __exec_args); \
-   LLVMDeleteFunction(jit->function); \
+   LLVMOrcResourceTrackerRef __rt; \
+   exec_fn_t __exec = (exec_fn_t) llvm_exec_module(jit, __module_save, &__rt); \
+   __exec(); \
+   llvm_exec_done(jit, __rt); \
    LLVMDisposeBuilder(jit->builder); \
    jit->function = __function_save; \
    jit->builder = __builder_save; \
    } while (0)
 
-/* execute code and return an integer */
+/* execute code started with START_INT_EXEC and return an integer */
 #define INT_EXEC(r, n) \
    do { \
    LLVMBuildRet(jit->builder, n); \
-   LLVMRunFunctionPassManager(jit->pass, jit->function); \
    if (TRACE) \
       LLVMDumpModule(jit->module); \
-   LLVMGenericValueRef __exec_args[] = {}; \
-   LLVMGenericValueRef __val = LLVMRunFunction(jit->engine, jit->function, 0, __exec_args); \
-   r = LLVMGenericValueToInt(__val, 1); \
-   LLVMDeleteFunction(jit->function); \
+   LLVMOrcResourceTrackerRef __rt; \
+   int_exec_fn_t __exec = (int_exec_fn_t) llvm_exec_module(jit, __module_save, &__rt); \
+   r = __exec(); \
+   llvm_exec_done(jit, __rt); \
    LLVMDisposeBuilder(jit->builder); \
    jit->function = __function_save; \
    jit->builder = __builder_save; \
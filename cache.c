@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+/*
+   Objects compiled from optimised code are kept in a directory, one
+   file per object, named after the hash of the unoptimised IR and
+   everything else that went into compiling it. A later run compiling
+   the same IR loads the object instead of running the pass pipeline
+   and the code generator. Files are touched when used, and once the
+   directory grows beyond its cap the least recently used are deleted.
+*/
+
+char * cache_dir = NULL; /* NULL if there is no cache */
+size_t cache_max; /* size cap in bytes */
+size_t cache_bytes; /* size of the objects in the directory */
+
+long cache_hits = 0; /* statistics for the stats command */
+long cache_misses = 0;
+long cache_stores = 0;
+long cache_evictions = 0;
+
+/* An object in the cache directory, for eviction */
+typedef struct cache_entry_t {
+   char name[40];
+   time_t time;
+   size_t size;
+} cache_entry_t;
+
+/* Is name that of a cached object */
+int cache_is_object(const char * name)
+{
+   size_t len = strlen(name);
+
+   return len == 34 && strcmp(name + 32, ".o") == 0;
+}
+
+/*
+   Read the objects in the cache directory, returning how many there
+   are, and the entries themselves if entries is not NULL. The caller
+   frees them.
+*/
+int cache_scan(cache_entry_t ** entries)
+{
+   DIR * d = opendir(cache_dir);
+   struct dirent * e;
+   struct stat st;
+   char path[strlen(cache_dir) + 40];
+   int num = 0, alloc = 0;
+   cache_entry_t * arr = NULL;
+
+   cache_bytes = 0;
+
+   if (d == NULL)
+      return 0;
+
+   while ((e = readdir(d)) != NULL)
+   {
+      if (!cache_is_object(e->d_name))
+         continue;
+
+      sprintf(path, "%s/%s", cache_dir, e->d_name);
+      if (stat(path, &st) != 0)
+         continue;
+
+      cache_bytes += st.st_size;
+
+      if (entries == NULL)
+         continue;
+
+      if (num == alloc)
+      {
+         alloc = alloc == 0 ? 64 : 2*alloc;
+         arr = (cache_entry_t *) realloc(arr, alloc*sizeof(cache_entry_t));
+      }
+
+      strcpy(arr[num].name, e->d_name);
+      arr[num].time = st.st_mtime;
+      arr[num].size = st.st_size;
+      num++;
+   }
+
+   closedir(d);
+
+   if (entries != NULL)
+      *entries = arr;
+
+   return num;
+}
+
+int cache_entry_cmp(const void * a, const void * b)
+{
+   time_t ta = ((const cache_entry_t *) a)->time;
+   time_t tb = ((const cache_entry_t *) b)->time;
+
+   return ta < tb ? -1 : ta > tb;
+}
+
+/*
+   Delete the least recently used objects until another len bytes fit
+   under the cap
+*/
+void cache_evict(size_t len)
+{
+   cache_entry_t * entries;
+   char path[strlen(cache_dir) + 40];
+   int i, num;
+
+   num = cache_scan(&entries);
+   qsort(entries, num, sizeof(cache_entry_t), cache_entry_cmp);
+
+   for (i = 0; i < num && cache_bytes + len > cache_max; i++)
+   {
+      sprintf(path, "%s/%s", cache_dir, entries[i].name);
+      if (unlink(path) == 0)
+      {
+         cache_bytes -= entries[i].size;
+         cache_evictions++;
+      }
+   }
+
+   free(entries);
+}
+
+/*
+   Use dir as the cache directory, creating it if need be, holding at
+   most the given number of megabytes of objects
+*/
+void cache_init(const char * dir, long megabytes)
+{
+   if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+   {
+      perror(dir);
+      return;
+   }
+
+   cache_dir = strdup(dir);
+   cache_max = (size_t) megabytes << 20;
+
+   cache_scan(NULL);
+
+   /* the cap may be smaller than it was last time */
+   if (cache_bytes > cache_max)
+      cache_evict(0);
+}
+
+int cache_enabled(void)
+{
+   return cache_dir != NULL;
+}
+
+void cache_key_init(cache_key_t * key)
+{
+   key->h1 = 14695981039346656037UL;
+   key->h2 = 0;
+}
+
+/* Add the given data to the hash */
+void cache_hash(cache_key_t * key, const char * data, size_t len)
+{
+   size_t i;
+
+   for (i = 0; i < len; i++)
+   {
+      key->h1 = (key->h1 ^ (unsigned char) data[i])*1099511628211UL;
+      key->h2 = key->h2*31 + (unsigned char) data[i];
+   }
+
+   /* so that "ab" + "c" differs from "a" + "bc" */
+   key->h1 = (key->h1 ^ len)*1099511628211UL;
+   key->h2 = key->h2*31 + len;
+}
+
+void cache_path(char * path, cache_key_t * key)
+{
+   sprintf(path, "%s/%016lx%016lx.o", cache_dir, key->h1, key->h2);
+}
+
+/*
+   Return the object with the given key, in memory the caller frees,
+   or NULL if it is not in the cache
+*/
+char * cache_lookup(cache_key_t * key, size_t * len)
+{
+   char path[strlen(cache_dir) + 40];
+   struct stat st;
+   char * data;
+   int fd;
+
+   cache_path(path, key);
+
+   if ((fd = open(path, O_RDONLY)) < 0)
+   {
+      cache_misses++;
+      return NULL;
+   }
+
+   if (fstat(fd, &st) != 0 || (data = (char *) malloc(st.st_size + 1)) == NULL)
+   {
+      close(fd);
+      cache_misses++;
+      return NULL;
+   }
+
+   if (read(fd, data, st.st_size) != st.st_size)
+   {
+      free(data);
+      close(fd);
+      cache_misses++;
+      return NULL;
+   }
+
+   close(fd);
+   utime(path, NULL); /* it has been used */
+
+   *len = st.st_size;
+   cache_hits++;
+
+   return data;
+}
+
+/*
+   Delete the object with the given key, which cache_lookup returned
+   but which turned out not to be an object, e.g. because it was
+   truncated. It counts as a miss.
+*/
+void cache_discard(cache_key_t * key)
+{
+   char path[strlen(cache_dir) + 40];
+   struct stat st;
+
+   cache_path(path, key);
+
+   if (stat(path, &st) == 0 && unlink(path) == 0)
+      cache_bytes -= st.st_size;
+
+   cache_hits--;
+   cache_misses++;
+}
+
+/*
+   Store an object under the given key. It is written to a temporary
+   file first, so that another run never reads half an object.
+*/
+void cache_store(cache_key_t * key, const char * data, size_t len)
+{
+   char path[strlen(cache_dir) + 40];
+   char tmp[strlen(cache_dir) + 40];
+   struct stat st;
+   size_t old;
+   int fd, ok;
+
+   if (len > cache_max)
+      return;
+
+   if (cache_bytes + len > cache_max)
+      cache_evict(len);
+
+   sprintf(tmp, "%s/tmp.%d", cache_dir, (int) getpid());
+   if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+      return;
+
+   ok = (write(fd, data, len) == (ssize_t) len);
+   ok &= (close(fd) == 0);
+
+   /* the object may replace one another run stored under the same key */
+   cache_path(path, key);
+   old = stat(path, &st) == 0 ? st.st_size : 0;
+
+   if (ok && rename(tmp, path) == 0)
+   {
+      cache_bytes = cache_bytes - old + len;
+      cache_stores++;
+   } else
+      unlink(tmp);
+}
+
+void print_cache_stats(void)
+{
+   printf("cache: %ld hits, %ld misses, %ld stored, %ld evicted, %ld bytes (cap %ld)\n",
+          cache_hits, cache_misses, cache_stores, cache_evictions,
+          (long) cache_bytes, (long) cache_max);
+}
@@ -0,0 +1,40 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#include <stddef.h>
+#include <limits.h>
+
+#define CACHE_SIZE 256 /* default size cap of the object cache in megabytes */
+#define CACHE_SIZE_MAX (LONG_MAX >> 20) /* largest cap whose bytes fit in a long */
+
+/* Hash of everything that determines a cached object */
+typedef struct cache_key_t {
+   unsigned long h1; /* FNV-1a */
+   unsigned long h2; /* polynomial, as a check on h1 */
+} cache_key_t;
+
+void cache_init(const char * dir, long megabytes);
+
+int cache_enabled(void);
+
+void cache_key_init(cache_key_t * key);
+
+void cache_hash(cache_key_t * key, const char * data, size_t len);
+
+char * cache_lookup(cache_key_t * key, size_t * len);
+
+void cache_discard(cache_key_t * key);
+
+void cache_store(cache_key_t * key, const char * data, size_t len);
+
+void print_cache_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
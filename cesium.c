@@ -1,18 +1,27 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include <setjmp.h>
 
 #include "gc.h"
+#include "arena.h"
 #include "symbol.h"
 #include "ast.h"
 #include "types.h"
 #include "unify.h"
 #include "environment.h"
+#include "input.h"
+#include "cache.h"
+
+input_t * cs_input; /* where the parser reads its input from */
 
 #include "parser.c"
 
 #include <llvm-c/Core.h>  
 #include <llvm-c/Analysis.h>  
-#include <llvm-c/ExecutionEngine.h>  
 #include <llvm-c/Target.h>  
 #include <llvm-c/Transforms/Scalar.h> 
 
@@ -21,27 +30,190 @@
 
 extern jmp_buf exc;
 
-int main(void) {
+#ifndef CS_GC_LIB /* libraries programs compiled ahead of time link with */
+#define CS_GC_LIB "-lgc"
+#endif
+
+jit_t * cs_jit; /* for the stats command */
+
+/*
+   Print sizes of internal tables, for the stats command
+*/
+void print_stats(GREG * G)
+{
+    printf("parser: buffer %d, text %d, thunks %d, values %d (peak)\n", 
+           G->maxbuflen, G->maxtextlen, G->maxthunkslen, G->maxvalslen);
+    print_sym_stats();
+    print_arena_stats();
+    print_ast_stats();
+    print_type_stats();
+    print_jit_stats(cs_jit);
+    if (cache_enabled())
+        print_cache_stats();
+}
+
+/*
+   Build an executable from the program compiled ahead of time. It is
+   linked with the C library, the maths library for fmod, and the GC, 
+   which is all the runtime it needs. cc is run directly rather than
+   through the shell, so that output may contain any characters. 
+   Returns 0 on success.
+*/
+int compile_and_link(jit_t * jit, const char * output)
+{
+    char obj[] = "/tmp/csXXXXXX";
+    char libs[] = CS_GC_LIB;
+    const char * args[sizeof(libs)/2 + 6];
+    char * lib;
+    int fd, err, status, num = 0;
+    pid_t pid;
+
+    if ((fd = mkstemp(obj)) < 0)
+    {
+        perror(obj);
+        return 1;
+    }
+    close(fd);
+
+    if ((err = llvm_emit_program(jit, obj)) == 0)
+    {
+        args[num++] = "cc";
+        args[num++] = "-o";
+        args[num++] = output;
+        args[num++] = obj;
+        for (lib = strtok(libs, " "); lib != NULL; lib = strtok(NULL, " "))
+            args[num++] = lib;
+        args[num++] = "-lm";
+        args[num] = NULL;
+
+        if ((pid = fork()) == 0)
+        {
+            execvp(args[0], (char * const *) args);
+            perror(args[0]);
+            _exit(127);
+        }
+
+        err = (pid < 0 || waitpid(pid, &status, 0) < 0 
+                       || !WIFEXITED(status) || WEXITSTATUS(status) != 0);
+    }
+
+    unlink(obj);
+
+    return err;
+}
+
+void usage(void)
+{
+    fprintf(stderr, "usage: cs [-O0 | -O1 | -O2 | -O3] [--ipo] [--target-cpu cpu] [--cache dir] [--cache-size mb] [--echo] [file.cs | -]\n");
+    fprintf(stderr, "       cs [-O0 | -O1 | -O2 | -O3] [--ipo] [--target-cpu cpu] --emit-obj file.cs -o file.o\n");
+    fprintf(stderr, "       cs [-O0 | -O1 | -O2 | -O3] [--ipo] [--target-cpu cpu] --build file.cs -o file\n");
+    exit(1);
+}
+
+int main(int argc, char ** argv) {
     GC_INIT();
     GREG g;
  
     int jval, jval2;
     char c;
+    int i, fd, echo = 0, level = 2, ipo = 0;
+    const char * cache = NULL;
+    const char * cpu = NULL; /* the host CPU */
+    long cache_size = CACHE_SIZE;
+    const char * name = NULL;
+    const char * output = NULL;
+    char * end;
+    int emit = 0, build = 0;
+
+    /* 
+       With no file we run the interactive REPL, otherwise the whole 
+       script is compiled as one function and run once it has all been read
+    */
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--echo") == 0)
+            echo = 1;
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+            cache = argv[++i]; /* directory of compiled objects */
+        else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc)
+        {
+            cache_size = strtol(argv[++i], &end, 10); /* megabytes */
+            if (end == argv[i] || *end != '\0' 
+             || cache_size <= 0 || cache_size > CACHE_SIZE_MAX)
+                usage();
+        }
+        else if (strcmp(argv[i], "--emit-obj") == 0)
+            emit = 1; /* compile ahead of time, see llvm_emit_program */
+        else if (strcmp(argv[i], "--build") == 0)
+            build = 1;
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else if (strcmp(argv[i], "--target-cpu") == 0 && i + 1 < argc)
+            cpu = argv[++i]; /* e.g. skylake-avx512, see llvm_init */
+        else if (strcmp(argv[i], "--ipo") == 0)
+            ipo = 1; /* inline across functions, see llvm_link_bodies */
+        else if (argv[i][0] == '-' && argv[i][1] == 'O' 
+              && argv[i][2] >= '0' && argv[i][2] <= '3' && argv[i][3] == '\0')
+            level = argv[i][2] - '0'; /* optimisation level of hot code */
+        else if (name == NULL)
+            name = argv[i];
+        else
+            usage();
+    }
+
+    if ((emit || build) && (name == NULL || output == NULL || emit + build > 1))
+        usage();
+
+    if (cpu != NULL && !llvm_cpu_valid(cpu))
+    {
+        fprintf(stderr, "Unknown CPU %s\n", cpu);
+        usage();
+    }
+
+    if (name == NULL)
+    {
+        fd = 0;
+        echo = 1;
+    } else if (strcmp(name, "-") == 0)
+        fd = 0;
+    else if ((fd = open(name, O_RDONLY)) < 0)
+    {
+        perror(name);
+        exit(1);
+    }
+
+    cs_input = input_open(fd);
 
     sym_tab_init();
+    arena_init();
     ast_init();
     type_init();
     scope_init();
-    rel_assign_init();
+    trail_init();
 
-    jit_t * jit = llvm_init();
+    if (cache != NULL)
+        cache_init(cache, cache_size);
+
+    jit_t * jit = llvm_init(level, ipo, cpu);
+    jit->echo = echo;
+    cs_jit = jit;
+
+    if (emit || build)
+        llvm_program_begin(jit);
+
+    arena_promote(); /* keep the objects made during initialisation */
+    ast_promote();
 
     yyinit(&g);
 
-    printf("Welcome to Cesium v 0.2\n");
-    printf("To exit press CTRL-D\n\n");
+    if (name == NULL)
+    {
+        printf("Welcome to Cesium v 0.2\n");
+        printf("To exit press CTRL-D\n\n");
 
-    printf("> ");
+        printf("> ");
+    } else
+        exec_script_begin(jit);
 
     while (1)
     {
@@ -51,28 +223,62 @@ int main(void) {
           {
              printf("Error parsing\n");
              abort();
+          } else if (syntax_error)
+          {
+             if (name != NULL) /* as for any other error in a script */
+                exit(1);
+             syntax_error = 0;
           } else if (root != NULL)
           {
              rel_stack_init();
-             rel_assign_mark();
+             trail_commit();
              scope_mark();
              annotate_ast(root);
              if (TRACE) 
                 ast_print(root, 0);
-             unify(rel_stack, rel_assign);
+             unify();
              if (TRACE)
-                print_assigns(rel_assign);
-             exec_root(jit, root);
-             if (root->tag != AST_FNDEC)
-                 rel_assign_rewind();
+                print_assigns();
+             if (name == NULL)
+                exec_root(jit, root);
+             else
+                exec_script_stmt(jit, root);
+
+             /* functions and datatypes keep their AST in the global scope */
+             if (root->tag == AST_FNDEC || root->tag == AST_DATATYPE)
+             {
+                arena_promote();
+                ast_promote();
+             } else
+             {
+                arena_reset();
+                ast_reset();
+             }
            }
         } else if (jval == 1)
+        {
+              if (name != NULL) /* the script can't be run any more */
+                 exit(1);
               root = NULL;
-        else if (jval == 2)
+              arena_reset();
+              ast_reset();
+        } else if (jval == 2)
               break;
-        printf("\n> ");
+        if (name == NULL)
+           printf("\n> ");
     }
   
+    if (name != NULL)
+        exec_script_end(jit);
+
+    if (emit && llvm_emit_program(jit, output))
+        exit(1);
+
+    if (build && compile_and_link(jit, output))
+        exit(1);
+
+    input_close(cs_input);
+
     yydeinit(&g);
     llvm_cleanup(jit);
 
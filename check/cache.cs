@@ -0,0 +1,18 @@
+fn count(n) {
+   var i = 0, s = 0;
+   while (i < n) {
+      s += i;
+      i++;
+   }
+   return s;
+}
+fn twice(n) {
+   var i = 0, s = 0;
+   while (i < n) {
+      s += 2*i;
+      i++;
+   }
+   return s;
+}
+count(100) + twice(100);
+stats;
@@ -0,0 +1,66 @@
+fn fact(n) {
+   if (n == 0)
+      return 1;
+   return n*fact(n - 1);
+}
+fact(10);
+
+fn sq(x) {
+   return x*x;
+}
+fn sumsq(n) {
+   var i = 0, s = 0;
+   while (i < n) {
+      s += sq(i);
+      i++;
+   }
+   return s;
+}
+sumsq(5000);
+
+fn adder(n) {
+   return lambda(m) { m + n };
+}
+var add3 = adder(3);
+add3(4);
+
+datatype point(x, y, name);
+var p = point(1, 2.5, "origin");
+p.x += 4;
+p.x;
+p.y;
+p.name;
+
+var t = (1, (2.5, "s"), true);
+t;
+1.5*4.0 - 0.25;
+7 % 3;
+3 < 4 && !(2 == 2);
+
+var len = 1000;
+fn fill(a, n) {
+   var i = 0;
+   while (i < n) {
+      a[i] = i;
+      i++;
+   }
+   return a;
+}
+fn total(a, n) {
+   var i = 0, s = 0;
+   while (i < n) {
+      s += a[i];
+      i++;
+   }
+   return s;
+}
+var a = array(len);
+total(fill(a, len), len);
+
+fn sq(x) {
+   return x + x;
+}
+sq(21);
+
+var statsum = 3; /* only stats itself is a keyword */
+statsum + 1;
@@ -0,0 +1,3 @@
+var x = 3;
+x + ;
+x + 4;
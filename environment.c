@@ -6,13 +6,23 @@
 
 #include <llvm-c/Core.h>  
 #include <llvm-c/Analysis.h>  
-#include <llvm-c/ExecutionEngine.h>  
 #include <llvm-c/Target.h>  
 #include <llvm-c/Transforms/Scalar.h> 
 
 env_t * current_scope;
 bind_t * scope_ptr;
 
+int scope_globals = 0; /* bindings in the global scope */
+int scope_shadowed = 0; /* globals hidden by a newer binding since the last sweep */
+
+/*
+   Each symbol points to its innermost binding in the scopes we are
+   currently in, and each binding to the one it shadows. Entering a
+   scope pushes its bindings onto these stacks and leaving it pops 
+   them, so the current scope must only be changed by the functions 
+   below.
+*/
+
 void scope_init(void)
 {
    current_scope = (env_t *) GC_MALLOC(sizeof(env_t));
@@ -21,31 +31,13 @@ void scope_init(void)
 
 int scope_is_global(bind_t * bind)
 {
-   env_t * s = current_scope;
-   while (s->next != NULL)
-      s = s->next;
-
-   bind_t * b = s->scope;
-   while (b != NULL)
-   {
-      if (b == bind)
-         return 1;
-      b = b->next;
-   }
-   return 0;
+   return bind != NULL && bind->depth == 0;
 }
 
+/* only meaningful for a binding that is in scope */
 int scope_is_current(bind_t * bind)
 {
-   bind_t * b = current_scope->scope;
-
-   while (b != NULL)
-   {
-      if (b == bind)
-         return 1;
-      b = b->next;
-   }
-   return 0;
+   return bind != NULL && bind->depth == current_scope->depth;
 }
 
 void scope_mark(void)
@@ -57,26 +49,97 @@ void scope_up(void)
 {
    env_t * env = (env_t *) GC_MALLOC(sizeof(env_t));
    env->next = current_scope;
+   env->depth = current_scope->depth + 1;
    current_scope = env;
    scope_ptr = NULL;   
 }
 
 void scope_down(void)
 {
+   bind_t * b;
+
+   for (b = current_scope->scope; b != NULL; b = b->next)
+      b->sym->bind = b->shadow;
+
    current_scope = current_scope->next;
 }
 
+/* make the bindings of an env visible, oldest first */
+void scope_push_binds(env_t * env)
+{
+   bind_t * b = env->scope, * prev = NULL, * next;
+
+   /* reverse the list, then reverse it back pushing as we go */
+   while (b != NULL)
+   {
+      next = b->next;
+      b->next = prev;
+      prev = b;
+      b = next;
+   }
+
+   b = prev;
+   prev = NULL;
+   while (b != NULL)
+   {
+      b->shadow = b->sym->bind;
+      b->sym->bind = b;
+
+      next = b->next;
+      b->next = prev;
+      prev = b;
+      b = next;
+   }
+
+   env->scope = prev;
+}
+
+/* enter env and any enclosing scopes we are not yet in */
+void scope_enter_from(env_t * env)
+{
+   if (env == current_scope)
+      return;
+
+   scope_enter_from(env->next);
+   scope_push_binds(env);
+   current_scope = env;
+}
+
+/*
+   Make env the current scope, leaving scopes until we are in one
+   that encloses it
+*/
+void scope_enter(env_t * env)
+{
+   env_t * s;
+
+   while (1)
+   {
+      for (s = env; s->depth > current_scope->depth; s = s->next) ;
+      if (s == current_scope)
+         break;
+      scope_down();
+   }
+
+   scope_enter_from(env);
+}
+
 void rewind_scope()
 {
-    if (current_scope->next != NULL)
-    {
-        while (current_scope->next != NULL)
-            scope_down();
-    }
+    bind_t * b;
+
+    while (current_scope->next != NULL)
+        scope_down();
+    
     if (scope_is_global(scope_ptr))
     {
         while (current_scope->scope != scope_ptr)
-            current_scope->scope = current_scope->scope->next;
+        {
+            b = current_scope->scope;
+            b->sym->bind = b->shadow;
+            current_scope->scope = b->next;
+            scope_globals--;
+        }
     } else
         scope_ptr = NULL;
 }
@@ -101,75 +164,98 @@ void scope_print(void)
   }
 }
 
-bind_t * bind_symbol(sym_t * sym, type_t * type, LLVMValueRef val)
+/* add a binding to the current scope, hiding any for the same symbol */
+bind_t * new_bind(sym_t * sym, type_t * type)
 {
-   bind_t * scope = current_scope->scope;
    bind_t * b = (bind_t *) GC_MALLOC(sizeof(bind_t));
    b->sym = sym;
    b->type = type;
-   b->val = val;
-   b->next = scope;
+   b->depth = current_scope->depth;
+   if (b->depth == 0)
+   {
+      scope_globals++;
+      if (sym->bind != NULL && sym->bind->depth == 0)
+         scope_shadowed++;
+   }
+   b->shadow = sym->bind;
+   sym->bind = b;
+   b->next = current_scope->scope;
    current_scope->scope = b;
    return b;
 }
 
+bind_t * bind_symbol(sym_t * sym, type_t * type, LLVMValueRef val)
+{
+   bind_t * b = new_bind(sym, type);
+   b->val = val;
+   return b;
+}
+
 bind_t * bind_lambda(sym_t * sym, type_t * type, ast_t * ast)
 {
-   bind_t * scope = current_scope->scope;
-   bind_t * b = (bind_t *) GC_MALLOC(sizeof(bind_t));
-   b->sym = sym;
-   b->type = type;
+   bind_t * b = new_bind(sym, type);
    b->ast = ast;
-   b->next = scope;
-   current_scope->scope = b;
    return b;
 }
 
 bind_t * bind_datatype(sym_t * sym, type_t * type, ast_t * ast)
 {
-   bind_t * scope = current_scope->scope;
-   bind_t * b = (bind_t *) GC_MALLOC(sizeof(bind_t));
-   b->sym = sym;
-   b->type = type;
+   bind_t * b = new_bind(sym, type);
    b->ast = ast;
-   b->next = scope;
-   current_scope->scope = b;
    return b;
 }
 
 bind_t * find_symbol(sym_t * sym)
 {
-   env_t * s = current_scope;
-   bind_t * b;
+   return sym->bind;
+}
 
-   while (s != NULL)
-   {
-      b = s->scope;
- 
-      while (b != NULL)
-      {
-         if (b->sym == sym)
-            return b;
-         b = b->next;
-      }
-      
-      s = s->next;
-   }
+bind_t * find_symbol_in_scope(sym_t * sym)
+{
+   bind_t * b = sym->bind;
+
+   if (b != NULL && b->depth == current_scope->depth)
+      return b;
 
    return NULL;
 }
 
-bind_t * find_symbol_in_scope(sym_t * sym)
+/*
+   Unlink global bindings that are hidden by a newer binding of the 
+   same symbol and that no function or lambda body refers to. Nothing
+   can reach them any more. Only done once enough globals have been 
+   shadowed to pay for walking the global scope. Returns the bindings
+   removed, chained through next, so the backend can free what they 
+   hold. Must be called from the global scope between statements.
+*/
+bind_t * scope_sweep(void)
 {
-   bind_t * b = current_scope->scope;
+   bind_t * b, * p, * next, * dead = NULL, ** prev;
 
-   while (b != NULL)
+   if (2*scope_shadowed <= scope_globals)
+      return NULL;
+
+   prev = &current_scope->scope;
+   for (b = current_scope->scope; b != NULL; b = next)
    {
-      if (b->sym == sym)
-         return b;
-      b = b->next;
+      next = b->next;
+
+      if (b->sym->bind != b && !b->used)
+      {
+         /* unlink from the chain of bindings of the symbol */
+         for (p = b->sym->bind; p->shadow != b; p = p->shadow) ;
+         p->shadow = b->shadow;
+
+         *prev = next;
+         b->next = dead;
+         dead = b;
+         scope_globals--;
+      } else
+         prev = &b->next;
    }
 
-   return NULL;
-}
+   scope_shadowed = 0;
+   scope_ptr = current_scope->scope; /* the old mark may be gone */
 
+   return dead;
+}
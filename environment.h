@@ -3,7 +3,7 @@
 
 #include <llvm-c/Core.h>  
 #include <llvm-c/Analysis.h>  
-#include <llvm-c/ExecutionEngine.h>  
+#include <llvm-c/Orc.h>  
 #include <llvm-c/Target.h>  
 #include <llvm-c/Transforms/Scalar.h> 
 
@@ -21,7 +21,11 @@ typedef struct bind_t
    type_t * type;
    sym_t * sym;
    LLVMValueRef val;
+   LLVMOrcResourceTrackerRef rt; /* removes the module a global or function lives in */
    int initialised;
+   int depth; /* of the scope the binding is in, the global scope is 0 */
+   int used; /* a global referred to from a function or lambda body, or a function value */
+   struct bind_t * shadow; /* binding of the same symbol this one hides */
    struct bind_t * next;
 } bind_t;
 
@@ -29,10 +33,15 @@ typedef struct env_t
 {
    bind_t * scope;
    struct env_t * next;
+   int depth;
+   bind_t ** bind_arr; /* locals a function's lambdas capture */
+   int bind_num;
 } env_t;
 
 extern env_t * current_scope;
 
+extern int scope_globals;
+
 void scope_init(void);
 
 int scope_is_global(bind_t * bind);
@@ -47,6 +56,8 @@ void scope_up(void);
 
 void scope_down(void);
 
+void scope_enter(env_t * env);
+
 void scope_print(void);
 
 bind_t * bind_symbol(sym_t * sym, type_t * type, LLVMValueRef val);
@@ -59,6 +70,8 @@ bind_t * find_symbol(sym_t * sym);
 
 bind_t * find_symbol_in_scope(sym_t * sym);
 
+bind_t * scope_sweep(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -9,7 +9,7 @@ jmp_buf exc;
 void exception(const char * msg)
 {
    rewind_scope();
-   rel_assign_rewind();
+   trail_rewind();
 
    fprintf(stderr, msg);
    
@@ -20,7 +20,7 @@ void jit_exception(jit_t * jit, const char * msg)
 {
    llvm_reset(jit);
    rewind_scope();
-   rel_assign_rewind();
+   trail_rewind();
    jit->bind_num = 0;
 
    fprintf(stderr, msg);
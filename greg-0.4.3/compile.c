@@ -74,13 +74,10 @@ done:
   return c;
 }
 
-static char *makeCharClass(unsigned char *cclass)
+static void makeCharClassBits(unsigned char *cclass, unsigned char bits[])
 {
-  unsigned char  bits[32];
   setter         set;
   int            c, prev= -1;
-  static char    string[256];
-  char          *ptr;
 
   if ('^' == *cclass)
     {
@@ -106,6 +103,13 @@ static char *makeCharClass(unsigned char *cclass)
     set(bits, prev= c);
   }
     }
+}
+
+static char *charClassString(unsigned char bits[])
+{
+  static char    string[256];
+  char          *ptr;
+  int            c;
 
   ptr= string;
   for (c= 0;  c < 32;  ++c)
@@ -114,6 +118,138 @@ static char *makeCharClass(unsigned char *cclass)
   return string;
 }
 
+static char *makeCharClass(unsigned char *cclass)
+{
+  unsigned char  bits[32];
+
+  makeCharClassBits(cclass, bits);
+
+  return charClassString(bits);
+}
+
+/* Add the characters that can begin a match of node to bits.  Returns
+ * non-zero if node can succeed without consuming a character, in which
+ * case bits says nothing about whether it will match.
+ */
+static int firstSet(Node *node, unsigned char bits[])
+{
+  int i;
+
+  switch (node->type)
+    {
+    case Name:
+      {
+        Node *rule= node->name.rule;
+        if (!(RuleFirst & rule->rule.flags))
+          {
+            if (RuleReached & rule->rule.flags)
+              return 1;
+            rule->rule.flags |= RuleReached;
+            rule->rule.first= (unsigned char *)calloc(32, 1);
+            if (!rule->rule.expression || firstSet(rule->rule.expression, rule->rule.first))
+              rule->rule.flags |= RuleNullable;
+            rule->rule.flags &= ~RuleReached;
+            rule->rule.flags |= RuleFirst;
+          }
+        for (i= 0;  i < 32;  ++i)
+          bits[i] |= rule->rule.first[i];
+        return RuleNullable & rule->rule.flags;
+      }
+
+    case Dot:
+      memset(bits, 255, 32);
+      return 0;
+
+    case Character:
+    case String:
+      {
+        unsigned char *value= (unsigned char *)node->string.value;
+        if (!*value)
+          return 1;
+        charClassSet(bits, readChar(&value));
+        return 0;
+      }
+
+    case Class:
+      {
+        unsigned char cbits[32];
+        makeCharClassBits(node->cclass.value, cbits);
+        for (i= 0;  i < 32;  ++i)
+          bits[i] |= cbits[i];
+        return 0;
+      }
+
+    case Alternate:
+      {
+        int nullable= 0;
+        for (node= node->alternate.first;  node;  node= node->alternate.next)
+          nullable |= firstSet(node, bits);
+        return nullable;
+      }
+
+    case Sequence:
+      for (node= node->sequence.first;  node;  node= node->sequence.next)
+        if (!firstSet(node, bits))
+          return 0;
+      return 1;
+
+    case Query:
+    case Star:
+      firstSet(node->query.element, bits);
+      return 1;
+
+    case Plus:
+      return firstSet(node->plus.element, bits);
+
+    default: /* actions, predicates and lookahead consume nothing */
+      return 1;
+    }
+}
+
+/* Does node contain an error block, which must run whenever it fails */
+static int hasErrBlock(Node *node)
+{
+  if (!node)
+    return 0;
+  if (node->any.errblock)
+    return 1;
+  switch (node->type)
+    {
+    case Rule:          return hasErrBlock(node->rule.expression);
+    case Alternate:
+    case Sequence:
+      for (node= node->alternate.first;  node;  node= node->alternate.next)
+        if (hasErrBlock(node))
+          return 1;
+      return 0;
+    case PeekFor:
+    case PeekNot:
+    case Query:
+    case Star:
+    case Plus:          return hasErrBlock(node->query.element);
+    default:            return 0;
+    }
+}
+
+static int guards= 1;
+
+/* Jump to ko without trying node if the next character can't begin it */
+static void guard(Node *node, int ko)
+{
+  unsigned char bits[32];
+  int i;
+
+  if (!guards)
+    return;
+  memset(bits, 0, 32);
+  if (firstSet(node, bits))
+    return;
+  for (i= 0;  i < 32 && 255 == bits[i];  ++i);
+  if (32 == i)
+    return;
+  fprintf(output, "  if (!yypeekClass(G, (unsigned char *)\"%s\")) goto l%d;", charClassString(bits), ko);
+}
+
 static void begin(void)         { fprintf(output, "\n  {"); }
 static void end(void)           { fprintf(output, "\n  }"); }
 static void label(int n)        { fprintf(output, "\n  l%d:;\t", n); }
@@ -183,13 +319,17 @@ static void Node_compile_c_ko(Node *node, int ko)
           if (node->alternate.next)
             {
               int next= yyl();
+              guard(node, next);
               Node_compile_c_ko(node, next);
               jump(ok);
               label(next);
               restore(ok);
             }
           else
-            Node_compile_c_ko(node, ko);
+            {
+              guard(node, ko);
+              Node_compile_c_ko(node, ko);
+            }
         end();
         label(ok);
       }
@@ -229,6 +369,7 @@ static void Node_compile_c_ko(Node *node, int ko)
         int qko= yyl(), qok= yyl();
         begin();
         save(qko);
+        guard(node->query.element, qko);
         Node_compile_c_ko(node->query.element, qko);
         jump(qok);
         label(qko);
@@ -244,6 +385,7 @@ static void Node_compile_c_ko(Node *node, int ko)
         label(again);
         begin();
         save(out);
+        guard(node->star.element, out);
         Node_compile_c_ko(node->star.element, out);
         jump(again);
         label(out);
@@ -259,6 +401,7 @@ static void Node_compile_c_ko(Node *node, int ko)
         label(again);
         begin();
         save(out);
+        guard(node->plus.element, out);
         Node_compile_c_ko(node->plus.element, out);
         jump(again);
         label(out);
@@ -322,7 +465,10 @@ static void Rule_compile_c2(Node *node)
 
       safe= ((Query == node->rule.expression->type) || (Star == node->rule.expression->type));
 
-      fprintf(output, "\nYY_RULE(int) yy_%s(GREG *G)\n{", node->rule.name);
+      if (RuleMemo & node->rule.flags)
+        fprintf(output, "\nYY_RULE(int) yyM_%s(GREG *G)\n{", node->rule.name);
+      else
+        fprintf(output, "\nYY_RULE(int) yy_%s(GREG *G)\n{", node->rule.name);
       fprintf(output, "  int yytextpos = 0; yytextpos=yytextpos;\n");
       if (!safe) save(0);
       if (node->rule.variables)
@@ -341,6 +487,8 @@ static void Rule_compile_c2(Node *node)
           fprintf(output, "\n  return 0;");
         }
       fprintf(output, "\n}");
+      if (RuleMemo & node->rule.flags)
+        fprintf(output, "\n\nYY_RULE(int) yy_%s(GREG *G)\n{\n  return yyMemo(G, yyM_%s, %d);\n}", node->rule.name, node->rule.name, node->rule.id);
     }
 
   if (node->rule.next)
@@ -419,6 +567,10 @@ static char *preamble= "\
 #define YY_BUFFER_START_SIZE 1024\n\
 #endif\n\
 \n\
+#ifndef YY_RETAIN_SIZE\n\
+#define YY_RETAIN_SIZE 65536\n\
+#endif\n\
+\n\
 #ifndef YY_PART\n\
 #define yydata G->data\n\
 #define yy G->ss\n\
@@ -426,6 +578,7 @@ static char *preamble= "\
 struct _yythunk; // forward declaration\n\
 typedef void (*yyaction)(struct _GREG *G, char *yytext, int yyleng, struct _yythunk *thunkpos, YY_XTYPE YY_XVAR);\n\
 typedef struct _yythunk { int begin, end;  yyaction  action;  struct _yythunk *next; } yythunk;\n\
+typedef struct _yymemo { int gen, rule, pos, ok, endpos, begin, end, thunk, thunkslen; } yymemo;\n\
 \n\
 typedef struct _GREG {\n\
   char *buf;\n\
@@ -444,6 +597,17 @@ typedef struct _GREG {\n\
   YYSTYPE *val;\n\
   YYSTYPE *vals;\n\
   int valslen;\n\
+  yymemo *memo;\n\
+  int memolen;\n\
+  int memocount;\n\
+  int memogen;\n\
+  yythunk *memothunks;\n\
+  int memothunkslen;\n\
+  int memothunkpos;\n\
+  int maxbuflen;\n\
+  int maxtextlen;\n\
+  int maxthunkslen;\n\
+  int maxvalslen;\n\
   YY_XTYPE data;\n\
 } GREG;\n\
 \n\
@@ -455,6 +619,7 @@ YY_LOCAL(int) yyrefill(GREG *G)\n\
       G->buflen *= 2;\n\
       G->buf= (char*)YY_REALLOC(G->buf, G->buflen, G->data);\n\
     }\n\
+  if (G->buflen > G->maxbuflen) G->maxbuflen= G->buflen;\n\
   YY_INPUT((G->buf + G->pos), yyn, (G->buflen - G->pos), G->data);\n\
   if (!yyn) return 0;\n\
   G->limit += yyn;\n\
@@ -513,6 +678,14 @@ YY_LOCAL(int) yymatchClass(GREG *G, unsigned char *bits)\n\
   return 0;\n\
 }\n\
 \n\
+YY_LOCAL(int) yypeekClass(GREG *G, unsigned char *bits)\n\
+{\n\
+  int c;\n\
+  if (G->pos >= G->limit && !yyrefill(G)) return 0;\n\
+  c= (unsigned char)G->buf[G->pos];\n\
+  return bits[c >> 3] & (1 << (c & 7));\n\
+}\n\
+\n\
 YY_LOCAL(void) yyDo(GREG *G, yyaction action, int begin, int end)\n\
 {\n\
   while (G->thunkpos >= G->thunkslen)\n\
@@ -520,6 +693,7 @@ YY_LOCAL(void) yyDo(GREG *G, yyaction action, int begin, int end)\n\
       G->thunkslen *= 2;\n\
       G->thunks= (yythunk*)YY_REALLOC(G->thunks, sizeof(yythunk) * G->thunkslen, G->data);\n\
     }\n\
+  if (G->thunkslen > G->maxthunkslen) G->maxthunkslen= G->thunkslen;\n\
   G->thunks[G->thunkpos].begin=  begin;\n\
   G->thunks[G->thunkpos].end=    end;\n\
   G->thunks[G->thunkpos].action= action;\n\
@@ -533,11 +707,12 @@ YY_LOCAL(int) yyText(GREG *G, int begin, int end)\n\
     yyleng= 0;\n\
   else\n\
     {\n\
-      while (G->textlen < (yyleng - 1))\n\
+      while (G->textlen < (yyleng + 1))\n\
         {\n\
           G->textlen *= 2;\n\
           G->text= (char*)YY_REALLOC(G->text, G->textlen, G->data);\n\
         }\n\
+      if (G->textlen > G->maxtextlen) G->maxtextlen= G->textlen;\n\
       memcpy(G->text, G->buf + begin, yyleng);\n\
     }\n\
   G->text[yyleng]= '\\0';\n\
@@ -567,6 +742,8 @@ YY_LOCAL(void) yyCommit(GREG *G)\n\
   G->begin -= G->pos;\n\
   G->end -= G->pos;\n\
   G->pos= G->thunkpos= 0;\n\
+  ++G->memogen;\n\
+  G->memocount= G->memothunkpos= 0;\n\
 }\n\
 \n\
 YY_LOCAL(int) yyAccept(GREG *G, int tp0)\n\
@@ -584,7 +761,97 @@ YY_LOCAL(int) yyAccept(GREG *G, int tp0)\n\
   return 1;\n\
 }\n\
 \n\
-YY_LOCAL(void) yyPush(GREG *G, char *text, int count, yythunk *thunk, YY_XTYPE YY_XVAR) { G->val += count; }\n\
+/* Memo table for rules compiled with -m, valid until the next commit */\n\
+YY_LOCAL(yymemo *) yyMemoFind(GREG *G, int rule, int pos)\n\
+{\n\
+  unsigned int h= ((unsigned int)pos * 2654435761u) ^ (unsigned int)rule;\n\
+  for (;;)\n\
+    {\n\
+      yymemo *m= &G->memo[h & (G->memolen - 1)];\n\
+      if (m->gen != G->memogen || (m->rule == rule && m->pos == pos))\n\
+        return m;\n\
+      ++h;\n\
+    }\n\
+}\n\
+\n\
+YY_LOCAL(void) yyMemoGrow(GREG *G)\n\
+{\n\
+  yymemo *old= G->memo;\n\
+  int i, oldlen= G->memolen;\n\
+  if (oldlen)\n\
+    G->memolen= oldlen * 2;\n\
+  else\n\
+    for (G->memolen= 1;  G->memolen < YY_STACK_SIZE;  G->memolen *= 2);  /* a power of two, see yyMemoFind */\n\
+  G->memo= (yymemo*)YY_CALLOC(G->memolen, sizeof(yymemo), G->data);\n\
+  for (i= 0;  i < oldlen;  ++i)\n\
+    if (old[i].gen == G->memogen)\n\
+      *yyMemoFind(G, old[i].rule, old[i].pos)= old[i];\n\
+  if (old) YY_FREE(old);\n\
+}\n\
+\n\
+YY_LOCAL(int) yyMemo(GREG *G, int (*rule)(GREG *G), int id)\n\
+{\n\
+  int pos= G->pos, thunkpos= G->thunkpos, ok, n;\n\
+  yymemo *m;\n\
+  if (!G->memolen)\n\
+    yyMemoGrow(G);\n\
+  m= yyMemoFind(G, id, pos);\n\
+  if (m->gen == G->memogen)\n\
+    {\n\
+      yyprintf((stderr, \"  memo %s %d @ %s\\n\", m->ok ? \"ok  \" : \"fail\", id, G->buf+G->pos));\n\
+      if (m->ok)\n\
+        {\n\
+          while (G->thunkpos + m->thunkslen >= G->thunkslen)\n\
+            {\n\
+              G->thunkslen *= 2;\n\
+              G->thunks= (yythunk*)YY_REALLOC(G->thunks, sizeof(yythunk) * G->thunkslen, G->data);\n\
+            }\n\
+          if (G->thunkslen > G->maxthunkslen) G->maxthunkslen= G->thunkslen;\n\
+          memcpy(G->thunks + G->thunkpos, G->memothunks + m->thunk, sizeof(yythunk) * m->thunkslen);\n\
+          G->thunkpos += m->thunkslen;\n\
+          G->pos= m->endpos;\n\
+        }\n\
+      G->begin= m->begin;\n\
+      G->end= m->end;\n\
+      return m->ok;\n\
+    }\n\
+  ok= rule(G);\n\
+  if (2 * (G->memocount + 1) > G->memolen)\n\
+    yyMemoGrow(G);\n\
+  m= yyMemoFind(G, id, pos);\n\
+  m->gen= G->memogen;\n\
+  m->ok= ok;\n\
+  m->rule= id;\n\
+  m->pos= pos;\n\
+  m->endpos= G->pos;\n\
+  m->begin= G->begin;\n\
+  m->end= G->end;\n\
+  m->thunk= G->memothunkpos;\n\
+  m->thunkslen= n= ok ? G->thunkpos - thunkpos : 0;\n\
+  while (G->memothunkpos + n >= G->memothunkslen)\n\
+    {\n\
+      G->memothunkslen= G->memothunkslen ? G->memothunkslen * 2 : YY_STACK_SIZE;\n\
+      G->memothunks= (yythunk*)YY_REALLOC(G->memothunks, sizeof(yythunk) * G->memothunkslen, G->data);\n\
+    }\n\
+  memcpy(G->memothunks + G->memothunkpos, G->thunks + thunkpos, sizeof(yythunk) * n);\n\
+  G->memothunkpos += n;\n\
+  ++G->memocount;\n\
+  return ok;\n\
+}\n\
+\n\
+\n\
+YY_LOCAL(void) yyPush(GREG *G, char *text, int count, yythunk *thunk, YY_XTYPE YY_XVAR)\n\
+{\n\
+  int valpos= G->val - G->vals;\n\
+  while (valpos + count >= G->valslen)\n\
+    {\n\
+      G->valslen *= 2;\n\
+      G->vals= (YYSTYPE*)YY_REALLOC(G->vals, sizeof(YYSTYPE) * G->valslen, G->data);\n\
+    }\n\
+  if (G->valslen > G->maxvalslen) G->maxvalslen= G->valslen;\n\
+  G->val= G->vals + valpos + count;\n\
+}\n\
+\n\
 YY_LOCAL(void) yyPop(GREG *G, char *text, int count, yythunk *thunk, YY_XTYPE YY_XVAR)  { G->val -= count; }\n\
 YY_LOCAL(void) yySet(GREG *G, char *text, int count, yythunk *thunk, YY_XTYPE YY_XVAR)  { G->val[count]= G->ss; }\n\
 \n\
@@ -600,6 +867,43 @@ static char *footer= "\n\
 \n\
 typedef int (*yyrule)(GREG *G);\n\
 \n\
+/* Give back any buffer a previous parse grew beyond YY_RETAIN_SIZE bytes */\n\
+YY_LOCAL(void) yyShrink(GREG *G)\n\
+{\n\
+  if (G->buflen > YY_RETAIN_SIZE && G->limit <= YY_BUFFER_START_SIZE - 512)\n\
+    {\n\
+      G->buflen= YY_BUFFER_START_SIZE;\n\
+      G->buf= (char*)YY_REALLOC(G->buf, G->buflen, G->data);\n\
+    }\n\
+  if (G->textlen > YY_RETAIN_SIZE)\n\
+    {\n\
+      G->textlen= YY_BUFFER_START_SIZE;\n\
+      G->text= (char*)YY_REALLOC(G->text, G->textlen, G->data);\n\
+    }\n\
+  if (sizeof(yythunk) * G->thunkslen > YY_RETAIN_SIZE)\n\
+    {\n\
+      G->thunkslen= YY_STACK_SIZE;\n\
+      G->thunks= (yythunk*)YY_REALLOC(G->thunks, sizeof(yythunk) * G->thunkslen, G->data);\n\
+    }\n\
+  if (sizeof(YYSTYPE) * G->valslen > YY_RETAIN_SIZE)\n\
+    {\n\
+      G->valslen= YY_STACK_SIZE;\n\
+      G->vals= (YYSTYPE*)YY_REALLOC(G->vals, sizeof(YYSTYPE) * G->valslen, G->data);\n\
+    }\n\
+  if (sizeof(yymemo) * G->memolen > YY_RETAIN_SIZE)\n\
+    {\n\
+      YY_FREE(G->memo);\n\
+      G->memo= 0;\n\
+      G->memolen= 0;\n\
+    }\n\
+  if (sizeof(yythunk) * G->memothunkslen > YY_RETAIN_SIZE)\n\
+    {\n\
+      YY_FREE(G->memothunks);\n\
+      G->memothunks= 0;\n\
+      G->memothunkslen= 0;\n\
+    }\n\
+}\n\
+\n\
 YY_PARSE(int) YY_NAME(parse_from)(GREG *G, yyrule yystart)\n\
 {\n\
   int yyok;\n\
@@ -614,7 +918,12 @@ YY_PARSE(int) YY_NAME(parse_from)(GREG *G, yyrule yystart)\n\
       G->valslen= YY_STACK_SIZE;\n\
       G->vals= (YYSTYPE*)YY_ALLOC(sizeof(YYSTYPE) * G->valslen, G->data);\n\
       G->begin= G->end= G->pos= G->limit= G->thunkpos= 0;\n\
+      G->memogen= 1;\n\
+      G->maxbuflen= G->maxtextlen= YY_BUFFER_START_SIZE;\n\
+      G->maxthunkslen= G->maxvalslen= YY_STACK_SIZE;\n\
     }\n\
+  else\n\
+    yyShrink(G);\n\
   G->pos = 0;\n\
   G->begin= G->end= G->pos;\n\
   G->thunkpos= 0;\n\
@@ -628,6 +937,7 @@ YY_PARSE(int) YY_NAME(parse_from)(GREG *G, yyrule yystart)\n\
   (void)yymatchChar;\n\
   (void)yymatchString;\n\
   (void)yymatchClass;\n\
+  (void)yypeekClass;\n\
   (void)yyDo;\n\
   (void)yyText;\n\
   (void)yyDone;\n\
@@ -636,6 +946,7 @@ YY_PARSE(int) YY_NAME(parse_from)(GREG *G, yyrule yystart)\n\
   (void)yyPush;\n\
   (void)yyPop;\n\
   (void)yySet;\n\
+  (void)yyMemo;\n\
 }\n\
 \n\
 YY_PARSE(int) YY_NAME(parse)(GREG *G)\n\
@@ -653,6 +964,8 @@ YY_PARSE(void) YY_NAME(deinit)(GREG *G)\n\
     if (G->text) YY_FREE(G->text);\n\
     if (G->thunks) YY_FREE(G->thunks);\n\
     if (G->vals) YY_FREE(G->vals);\n\
+    if (G->memo) YY_FREE(G->memo);\n\
+    if (G->memothunks) YY_FREE(G->memothunks);\n\
 }\n\
 YY_PARSE(GREG *) YY_NAME(parse_new)(YY_XTYPE data)\n\
 {\n\
@@ -746,6 +1059,11 @@ void Rule_compile_c(Node *node)
   for (n= rules;  n;  n= n->rule.next)
     consumesInput(n);
 
+  /* skipping an alternative would also skip its error block */
+  for (n= rules;  n;  n= n->rule.next)
+    if (hasErrBlock(n))
+      guards= 0;
+
   fprintf(output, "%s", preamble);
   for (n= node;  n;  n= n->rule.next)
     fprintf(output, "YY_RULE(int) yy_%s(GREG *G); /* %d */\n", n->rule.name, n->rule.id);
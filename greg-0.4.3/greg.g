@@ -197,6 +197,7 @@ static void usage(char *name)
   fprintf(stderr, "usage: %s [<option>...] [<file>...]\n", name);
   fprintf(stderr, "where <option> can be\n");
   fprintf(stderr, "  -h          print this help information\n");
+  fprintf(stderr, "  -m <rule>   memoise the results of <rule> (may be repeated)\n");
   fprintf(stderr, "  -o <ofile>  write output to <ofile>\n");
   fprintf(stderr, "  -v          be verbose\n");
   fprintf(stderr, "  -V          print version number and exit\n");
@@ -210,13 +211,15 @@ int main(int argc, char **argv)
   GREG *G;
   Node *n;
   int   c;
+  char **memo= (char **)calloc(argc, sizeof(char *));
+  int   memoCount= 0;
 
   output= stdout;
   input= stdin;
   lineNumber= 1;
   fileName= "<stdin>";
 
-  while (-1 != (c= getopt(argc, argv, "Vho:v")))
+  while (-1 != (c= getopt(argc, argv, "Vhm:o:v")))
     {
       switch (c)
 	{
@@ -228,6 +231,10 @@ int main(int argc, char **argv)
 	  usage(basename(argv[0]));
 	  break;
 
+	case 'm':
+	  memo[memoCount++]= optarg;
+	  break;
+
 	case 'o':
 	  if (!(output= fopen(optarg, "w")))
 	    {
@@ -279,6 +286,19 @@ int main(int argc, char **argv)
       yyerror(G, "syntax error");
   yyparse_free(G);
 
+  for (c= 0;  c < memoCount;  ++c)
+    {
+      for (n= rules;  n;  n= n->any.next)
+	if (!strcmp(n->rule.name, memo[c]))
+	  break;
+      if (!n)
+	{
+	  fprintf(stderr, "rule '%s' given to -m is not defined\n", memo[c]);
+	  exit(1);
+	}
+      n->rule.flags |= RuleMemo;
+    }
+
   if (verboseFlag)
     for (n= rules;  n;  n= n->any.next)
       Rule_print(n);
@@ -27,11 +27,14 @@ enum { Unknown= 0, Rule, Variable, Name, Dot, Character, String, Class, Action,
 enum {
   RuleUsed      = 1<<0,
   RuleReached   = 1<<1,
+  RuleMemo      = 1<<2,
+  RuleFirst     = 1<<3,
+  RuleNullable  = 1<<4,
 };
 
 typedef union Node Node;
 
-struct Rule      { int type;  Node *next;   char *errblock;  char *name;  Node *variables;  Node *expression;  int id;  int flags;       };
+struct Rule      { int type;  Node *next;   char *errblock;  char *name;  Node *variables;  Node *expression;  int id;  int flags;  unsigned char *first; };
 struct Variable  { int type;  Node *next;   char *errblock;  char *name;  Node *value;  int offset;                                      };
 struct Name      { int type;  Node *next;   char *errblock;  Node *rule;  Node *variable;                                                };
 struct Dot       { int type;  Node *next;   char *errblock;                                                                              };
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "gc.h"
+#include "input.h"
+
+/*
+   Set up parser input from the given file descriptor. Regular files 
+   are mapped into memory in one go, anything else (terminals, pipes) 
+   is read in blocks. A read on a terminal returns at most a line, so 
+   the REPL still sees its input a line at a time.
+*/
+input_t * input_open(int fd)
+{
+   input_t * in = (input_t *) GC_MALLOC(sizeof(input_t));
+   struct stat st;
+   off_t start;
+
+   in->fd = fd;
+   
+   if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+    && (start = lseek(fd, 0, SEEK_CUR)) != (off_t) -1 && st.st_size > start)
+   {
+      void * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      
+      if (map != MAP_FAILED)
+      {
+         in->buf = (char *) map;
+         in->len = st.st_size;
+         in->pos = start;
+         in->mapped = 1;
+         return in;
+      }
+   }
+
+   in->buf = (char *) GC_MALLOC(INPUT_BUF_SIZE);
+   
+   return in;
+}
+
+/*
+   Copy up to max_size bytes of input into buf, refilling our read 
+   buffer if it is empty. Returns 0 at the end of the input.
+*/
+size_t input_read(input_t * in, char * buf, size_t max_size)
+{
+   size_t n;
+
+   if (in->pos == in->len)
+   {
+      ssize_t r;
+
+      if (in->mapped)
+         return 0;
+
+      do {
+         r = read(in->fd, in->buf, INPUT_BUF_SIZE);
+      } while (r < 0 && errno == EINTR);
+
+      if (r <= 0)
+         return 0;
+
+      in->len = r;
+      in->pos = 0;
+   }
+
+   n = in->len - in->pos;
+   if (n > max_size)
+      n = max_size;
+
+   memcpy(buf, in->buf + in->pos, n);
+   in->pos += n;
+
+   return n;
+}
+
+/*
+   Release the input, closing the file unless it is stdin
+*/
+void input_close(input_t * in)
+{
+   if (in->mapped)
+      munmap(in->buf, in->len);
+
+   if (in->fd != 0)
+      close(in->fd);
+
+   in->buf = NULL;
+   in->len = in->pos = 0;
+}
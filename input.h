@@ -0,0 +1,30 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#include <stddef.h>
+
+#define INPUT_BUF_SIZE 65536
+
+typedef struct input_t {
+   int fd;
+   char * buf; /* read buffer, or the whole file if mapped */
+   size_t len; /* number of valid bytes in buf */
+   size_t pos; /* next byte to hand to the parser */
+   int mapped;
+} input_t;
+
+input_t * input_open(int fd);
+
+size_t input_read(input_t * in, char * buf, size_t max_size);
+
+void input_close(input_t * in);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
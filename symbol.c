@@ -4,53 +4,187 @@
 #include "symbol.h"
 
 sym_t ** sym_tab;
+int sym_tab_size; /* always a power of two */
+int sym_count;
+
+lit_t ** lit_tab; /* string literal pool, also a power of two */
+int lit_tab_size;
+int lit_count;
+
+/* probe statistics */
+long sym_lookups;
+long sym_probes;
+int sym_max_probe;
 
 void sym_tab_init(void)
 {
-    sym_tab = (sym_t **) GC_MALLOC(SYM_TAB_SIZE*sizeof(sym_t *));
+    sym_tab_size = SYM_TAB_INIT;
+    sym_count = 0;
+    sym_tab = (sym_t **) GC_MALLOC(sym_tab_size*sizeof(sym_t *));
+    
+    lit_tab_size = SYM_TAB_INIT;
+    lit_count = 0;
+    lit_tab = (lit_t **) GC_MALLOC(lit_tab_size*sizeof(lit_t *));
 }
 
-sym_t * new_symbol(const char * name, int length)
+sym_t * new_symbol(const char * name, int length, unsigned int hash)
 {
    sym_t * sym = (sym_t *) GC_MALLOC(sizeof(sym_t));
    sym->name = (char *) GC_MALLOC(length + 1);
-   strcpy(sym->name, name);
+   memcpy(sym->name, name, length + 1);
+   sym->length = length;
+   sym->hash = hash;
    return sym;
 }
 
 void print_sym_tab(void)
 {
     int i;
-    for (i = 0; i < SYM_TAB_SIZE; i++)
+    for (i = 0; i < sym_tab_size; i++)
         if (sym_tab[i])
             printf("%s\n", sym_tab[i]->name);
 }
 
-int sym_hash(const char * name, int length)
+void print_sym_stats(void)
 {
-    int hash = (int) name[0];
+    printf("symbols: %d in %d slots, %.2f probes per lookup, %d max\n", 
+           sym_count, sym_tab_size, 
+           sym_lookups ? (double) sym_probes / sym_lookups : 0.0, sym_max_probe);
+    printf("string literals: %d in %d slots\n", lit_count, lit_tab_size);
+}
+
+/*
+   FNV-1a, followed by a final mix so that the low bits we 
+   mask off depend on every character
+*/
+unsigned int sym_hash(const char * name, int length)
+{
+    unsigned int hash = 2166136261u;
     int i;
-    for (i = 1; i < length; i++)
-        hash += (name[i] << ((3*i) % 15));
-    return hash % SYM_TAB_SIZE;
+    
+    for (i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+/*
+   Double the size of the table, reinserting using the stored hashes
+*/
+void sym_tab_grow(void)
+{
+    sym_t ** old = sym_tab;
+    int old_size = sym_tab_size;
+    int i, j;
+
+    sym_tab_size *= 2;
+    sym_tab = (sym_t **) GC_MALLOC(sym_tab_size*sizeof(sym_t *));
+
+    for (i = 0; i < old_size; i++)
+    {
+        if (old[i])
+        {
+            j = old[i]->hash & (sym_tab_size - 1);
+            while (sym_tab[j])
+                j = (j + 1) & (sym_tab_size - 1);
+            sym_tab[j] = old[i];
+        }
+    }
 }
 
 sym_t * sym_lookup(const char * name)
 {
    int length = strlen(name);
-   int hash = sym_hash(name, length);
+   unsigned int hash = sym_hash(name, length);
+   int i = hash & (sym_tab_size - 1);
+   int probes = 1;
    sym_t * sym;
 
-   while (sym_tab[hash])
+   while ((sym = sym_tab[i]))
    {
-       if (strcmp(sym_tab[hash]->name, name) == 0)
-           return sym_tab[hash];
-       hash++;
-       if (hash == SYM_TAB_SIZE)
-           hash = 0;
+       if (sym->hash == hash && sym->length == length 
+        && memcmp(sym->name, name, length) == 0)
+           break;
+       i = (i + 1) & (sym_tab_size - 1);
+       probes++;
    }
 
-   sym = new_symbol(name, length);
-   sym_tab[hash] = sym;
+   sym_lookups++;
+   sym_probes += probes;
+   if (probes > sym_max_probe)
+       sym_max_probe = probes;
+
+   if (sym)
+       return sym;
+
+   sym = new_symbol(name, length, hash);
+   sym_tab[i] = sym;
+   
+   if (++sym_count*10 > sym_tab_size*SYM_TAB_LOAD)
+       sym_tab_grow();
+
    return sym;
 }
+
+/*
+   Double the size of the literal pool
+*/
+void lit_tab_grow(void)
+{
+    lit_t ** old = lit_tab;
+    int old_size = lit_tab_size;
+    int i, j;
+
+    lit_tab_size *= 2;
+    lit_tab = (lit_t **) GC_MALLOC(lit_tab_size*sizeof(lit_t *));
+
+    for (i = 0; i < old_size; i++)
+    {
+        if (old[i])
+        {
+            j = old[i]->hash & (lit_tab_size - 1);
+            while (lit_tab[j])
+                j = (j + 1) & (lit_tab_size - 1);
+            lit_tab[j] = old[i];
+        }
+    }
+}
+
+/*
+   Find the pooled copy of the given (unescaped) string literal, 
+   adding it if we haven't seen it before
+*/
+lit_t * lit_lookup(const char * str, int length)
+{
+   unsigned int hash = sym_hash(str, length);
+   int i = hash & (lit_tab_size - 1);
+   lit_t * lit;
+
+   while ((lit = lit_tab[i]))
+   {
+       if (lit->hash == hash && lit->length == length 
+        && memcmp(lit->str, str, length) == 0)
+           return lit;
+       i = (i + 1) & (lit_tab_size - 1);
+   }
+
+   lit = (lit_t *) GC_MALLOC(sizeof(lit_t) + length);
+   memcpy(lit->str, str, length);
+   lit->length = length;
+   lit->hash = hash;
+   lit_tab[i] = lit;
+   
+   if (++lit_count*10 > lit_tab_size*SYM_TAB_LOAD)
+       lit_tab_grow();
+
+   return lit;
+}
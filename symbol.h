@@ -3,7 +3,6 @@
 
 #include <llvm-c/Core.h>  
 #include <llvm-c/Analysis.h>  
-#include <llvm-c/ExecutionEngine.h>  
 #include <llvm-c/Target.h>  
 #include <llvm-c/Transforms/Scalar.h> 
 
@@ -13,19 +12,38 @@
 
 #include <string.h>
 
-#define SYM_TAB_SIZE 10000
+#define SYM_TAB_INIT 1024 /* initial number of slots, a power of two */
+
+#define SYM_TAB_LOAD 7 /* grow the table once it is 7/10 full */
 
 typedef struct sym_t {
    char * name;
+   int length;
+   unsigned int hash;
    LLVMValueRef val;
+   struct bind_t * bind; /* innermost binding of the symbol in scope */
 } sym_t;
 
+/* A string literal, unescaped and stored inline after its length */
+typedef struct lit_t {
+   int length;
+   unsigned int hash;
+   LLVMValueRef val; /* global holding the string, once jit'd */
+   char str[1];
+} lit_t;
+
 void sym_tab_init(void);
 
+unsigned int sym_hash(const char * name, int length);
+
 void print_sym_tab(void);
 
+void print_sym_stats(void);
+
 sym_t * sym_lookup(const char * name);
 
+lit_t * lit_lookup(const char * str, int length);
+
 #ifdef __cplusplus
 }
 #endif
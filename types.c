@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdint.h>
 #include "types.h"
 #include "gc.h"
 
@@ -9,6 +10,16 @@ type_t * t_double;
 type_t * t_string;
 type_t * t_char;
 
+/* 
+   Table of canonical types. A type whose parts are all canonical 
+   is looked up here when it is made, so equal types without typevars
+   are the same pointer
+*/
+type_t ** type_tab;
+int type_tab_size; /* always a power of two */
+int type_count;
+long type_hits; /* times an existing type was handed out */
+
 type_t * new_type(typ_t typ)
 {
    type_t * t = (type_t *) GC_MALLOC(sizeof(type_t));
@@ -19,86 +30,196 @@ type_t * new_type(typ_t typ)
 
 void type_init(void)
 {
+   type_tab_size = TYPE_TAB_INIT;
+   type_count = 0;
+   type_tab = (type_t **) GC_MALLOC(type_tab_size*sizeof(type_t *));
+
    t_nil = new_type(NIL);
    t_int = new_type(INT);
    t_bool = new_type(BOOL);
    t_double = new_type(DOUBLE);
    t_string = new_type(STRING);
    t_char = new_type(CHAR);
+
+   t_nil->canon = t_int->canon = t_bool->canon = 1;
+   t_double->canon = t_string->canon = t_char->canon = 1;
 }
 
-int type_equal(type_t * t1, type_t * t2)
+void print_type_stats(void)
 {
-   if (t1 == t2)
-      return 1;
-   return 0;
+   printf("types: %d canonical in %d slots, %ld reused\n", 
+          type_count, type_tab_size, type_hits);
 }
 
-type_t * fn_type(type_t * ret, int num, type_t ** param)
+unsigned int type_hash_ptr(unsigned int hash, void * p)
 {
-   type_t * t = (type_t *) GC_MALLOC(sizeof(type_t));
-   t->typ = FN;
-   t->param = (type_t **) GC_MALLOC(sizeof(type_t *)*num);
-   t->ret = ret;
-   t->arity = num;
+   uintptr_t v = (uintptr_t) p;
 
+   hash = (hash ^ (unsigned int) v)*16777619u;
+   return (hash ^ (unsigned int) (v >> 32))*16777619u;
+}
+
+unsigned int type_hash(typ_t typ, int num, type_t ** param, 
+                       type_t * ret, sym_t * sym, sym_t ** slot)
+{
+   unsigned int hash = (2166136261u ^ typ)*16777619u;
    int i;
+
+   hash = (hash ^ num)*16777619u;
+   hash = type_hash_ptr(hash, ret);
+   hash = type_hash_ptr(hash, sym);
    for (i = 0; i < num; i++)
-      t->param[i] = param[i];
+      hash = type_hash_ptr(hash, param[i]);
+   if (slot != NULL)
+      for (i = 0; i < num; i++)
+         hash = type_hash_ptr(hash, slot[i]);
 
-   return t;
+   hash ^= hash >> 16;
+   hash *= 0x85ebca6bu;
+   hash ^= hash >> 13;
+   hash *= 0xc2b2ae35u;
+   hash ^= hash >> 16;
+
+   return hash;
 }
 
-type_t * tuple_type(int num, type_t ** param)
+/*
+   Double the size of the table, reinserting using the stored hashes
+*/
+void type_tab_grow(void)
 {
-   type_t * t = (type_t *) GC_MALLOC(sizeof(type_t));
-   t->typ = TUPLE;
-   t->param = (type_t **) GC_MALLOC(sizeof(type_t *)*num);
-   t->arity = num;
+   type_t ** old = type_tab;
+   int old_size = type_tab_size;
+   int i, j;
 
-   int i;
-   for (i = 0; i < num; i++)
-      t->param[i] = param[i];
+   type_tab_size *= 2;
+   type_tab = (type_t **) GC_MALLOC(type_tab_size*sizeof(type_t *));
 
-   return t;
+   for (i = 0; i < old_size; i++)
+   {
+      if (old[i])
+      {
+         j = old[i]->hash & (type_tab_size - 1);
+         while (type_tab[j])
+            j = (j + 1) & (type_tab_size - 1);
+         type_tab[j] = old[i];
+      }
+   }
 }
 
-type_t * data_type(int num, type_t ** param, sym_t * sym, sym_t ** slot)
+/* 
+   Make a type with the given parts. If the parts are canonical we 
+   return the canonical type, making it if this is the first time,
+   otherwise a fresh type is made which unification may fill in
+*/
+type_t * make_type(typ_t typ, int num, type_t ** param, 
+                   type_t * ret, sym_t * sym, sym_t ** slot)
 {
-   type_t * t = (type_t *) GC_MALLOC(sizeof(type_t));
-   t->typ = DATATYPE;
-   t->param = (type_t **) GC_MALLOC(sizeof(type_t *)*num);
-   t->slot = (sym_t **) GC_MALLOC(sizeof(sym_t *)*num);
-   t->arity = num;
+   type_t * t;
+   unsigned int hash = 0;
+   int i, j, canon = 1;
 
-   int i;
-   for (i = 0; i < num; i++)
+   if (ret != NULL && !ret->canon)
+      canon = 0;
+   for (i = 0; i < num && canon; i++)
+      if (!param[i]->canon)
+         canon = 0;
+   if (typ == DATATYPE && sym == NULL) /* slot access, filled in by unify */
+      canon = 0;
+
+   if (canon)
    {
-       t->param[i] = param[i];
-       t->slot[i] = slot[i];
+      hash = type_hash(typ, num, param, ret, sym, slot);
+      j = hash & (type_tab_size - 1);
+
+      while ((t = type_tab[j]))
+      {
+         if (t->hash == hash && t->typ == typ && t->arity == num 
+          && t->ret == ret && t->sym == sym)
+         {
+            for (i = 0; i < num; i++)
+               if (t->param[i] != param[i] || (slot && t->slot[i] != slot[i]))
+                  break;
+            if (i == num)
+            {
+               type_hits++;
+               return t;
+            }
+         }
+         j = (j + 1) & (type_tab_size - 1);
+      }
    }
-   
+
+   t = (type_t *) GC_MALLOC(sizeof(type_t));
+   t->typ = typ;
+   t->arity = num;
+   t->ret = ret;
    t->sym = sym;
+   
+   if (typ != ARRAY)
+   {
+      t->param = (type_t **) GC_MALLOC(sizeof(type_t *)*num);
+      for (i = 0; i < num; i++)
+         t->param[i] = param[i];
+   }
+
+   if (slot != NULL)
+   {
+      t->slot = (sym_t **) GC_MALLOC(sizeof(sym_t *)*num);
+      for (i = 0; i < num; i++)
+         t->slot[i] = slot[i];
+   }
+
+   if (canon)
+   {
+      t->hash = hash;
+      t->canon = 1;
+      type_tab[j] = t;
+
+      if (++type_count*10 > type_tab_size*TYPE_TAB_LOAD)
+         type_tab_grow();
+   }
 
    return t;
 }
 
-type_t * array_type(type_t * param)
+int type_equal(type_t * t1, type_t * t2)
 {
-   type_t * t = (type_t *) GC_MALLOC(sizeof(type_t));
-   t->typ = ARRAY;
-   t->ret = param;
-   t->arity = 0;
+   if (t1 == t2)
+      return 1;
+   return 0;
+}
 
-   return t;
+type_t * fn_type(type_t * ret, int num, type_t ** param)
+{
+   return make_type(FN, num, param, ret, NULL, NULL);
+}
+
+/* the type of a lambda, i.e. a function carrying an environment */
+type_t * closure_type(type_t * ret, int num, type_t ** param)
+{
+   return make_type(LAMBDA, num, param, ret, NULL, NULL);
+}
+
+type_t * tuple_type(int num, type_t ** param)
+{
+   return make_type(TUPLE, num, param, NULL, NULL, NULL);
+}
+
+type_t * data_type(int num, type_t ** param, sym_t * sym, sym_t ** slot)
+{
+   return make_type(DATATYPE, num, param, NULL, sym, slot);
+}
+
+type_t * array_type(type_t * param)
+{
+   return make_type(ARRAY, 0, NULL, param, NULL, NULL);
 }
 
 /* convert to a lambda type */
 type_t * fn_to_lambda_type(type_t * type)
 {
-    type = fn_type(type->ret, type->arity, type->param);
-    type->typ = LAMBDA; 
-    return type;
+    return closure_type(type->ret, type->arity, type->param);
 }
 
 
@@ -110,6 +231,43 @@ type_t * new_typevar(void)
     return t;
 }
 
+/*
+   Return the canonical instance of a type that unification has 
+   filled in completely, or NULL if it still contains typevars
+*/
+type_t * type_canon(type_t * t)
+{
+    type_t * ret = NULL;
+    type_t * local[8], ** param = NULL;
+    int i;
+
+    if (t->canon)
+        return t;
+    
+    switch (t->typ)
+    {
+    case FN:
+    case LAMBDA:
+    case TUPLE:
+    case DATATYPE:
+        if (t->typ == DATATYPE && t->sym == NULL)
+            return NULL;
+        param = t->arity <= 8 ? local : (type_t **) GC_MALLOC(sizeof(type_t *)*t->arity);
+        for (i = 0; i < t->arity; i++)
+            if ((param[i] = type_canon(t->param[i])) == NULL)
+                return NULL;
+        /* fall through */
+    case ARRAY:
+        if (t->typ == ARRAY && t->arity != 0) /* length of an array still to be made */
+            return NULL;
+        if (t->ret != NULL && (ret = type_canon(t->ret)) == NULL)
+            return NULL;
+        return make_type(t->typ, t->arity, param, ret, t->sym, t->slot);
+    default: /* typevars */
+        return NULL;
+    }
+}
+
 void print_type(type_t * t)
 {
     int i;
@@ -13,6 +13,10 @@ typedef enum
    FN, LAMBDA, ARRAY, TUPLE, DATATYPE, TYPEVAR
 } typ_t;
 
+#define TYPE_TAB_INIT 1024 /* initial number of slots, a power of two */
+
+#define TYPE_TAB_LOAD 7 /* grow the table once it is 7/10 full */
+
 typedef struct type_t
 {
    typ_t typ;
@@ -21,6 +25,12 @@ typedef struct type_t
    struct type_t * ret;
    struct sym_t ** slot;
    struct sym_t * sym;
+   struct type_t * bound; /* what unify has bound a typevar to, if anything */
+   unsigned int hash;
+   int canon; /* the unique instance of a type with no typevars in it */
+   LLVMTypeRef llvm; /* cached by the backend on canonical types */
+   LLVMTypeRef llvm_s; /* struct a lambda, tuple, datatype or array points to */
+   LLVMTypeRef llvm_fn; /* function type of a lambda, with environment */
 } type_t;
 
 extern type_t * t_nil;
@@ -38,6 +48,8 @@ int type_equal(type_t * t1, type_t * t2);
 
 type_t * fn_type(type_t * ret, int num, type_t ** param);
 
+type_t * closure_type(type_t * ret, int num, type_t ** param);
+
 type_t * tuple_type(int num, type_t ** param);
 
 type_t * array_type(type_t * param);
@@ -48,6 +60,10 @@ type_t * fn_to_lambda_type(type_t * type);
 
 type_t * new_typevar(void);
 
+type_t * type_canon(type_t * t);
+
+void print_type_stats(void);
+
 void print_type(type_t * t);
 
 #ifdef __cplusplus
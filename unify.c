@@ -5,43 +5,72 @@
 #include "unify.h"
 #include "environment.h"
 #include "gc.h"
+#include "arena.h"
 #include "exception.h"
 
 #include <llvm-c/Core.h>  
 #include <llvm-c/Analysis.h>  
-#include <llvm-c/ExecutionEngine.h>  
 #include <llvm-c/Target.h>  
 #include <llvm-c/Transforms/Scalar.h> 
 
 type_rel_t * rel_stack;
-type_rel_t * rel_assign;
-type_rel_t * rel_assign_save;
+
+int fn_depth; /* function and lambda bodies annotate_ast is inside */
+
+/* 
+   Typevars are union-find nodes: unify binds a typevar by pointing
+   it at another type, and type_find follows the chain. Every change
+   is recorded on the trail so that a statement which fails can be 
+   undone. Bindings are kept once a statement has been compiled.
+*/
+type_trail_t * trail;
+int trail_len = 0;
+int trail_alloc = 0;
 
 void rel_stack_init(void)
 {
     rel_stack = NULL;
+    fn_depth = 0; /* an exception may have left us inside a body */
 }
 
-void rel_assign_init(void)
+void trail_init(void)
 {
     rel_stack = NULL;
-    rel_assign_save = NULL;
+    trail_len = 0;
+}
+
+/* keep all the bindings made so far */
+void trail_commit(void)
+{
+    trail_len = 0;
 }
 
-void rel_assign_mark(void)
+/* undo the bindings made since the last commit, newest first */
+void trail_rewind(void)
 {
-    rel_assign_save = rel_assign;
+    while (trail_len > 0)
+    {
+        trail_len--;
+        trail[trail_len].var->bound = trail[trail_len].old;
+    }
 }
 
-void rel_assign_rewind(void)
+void trail_push(type_t * var, type_t * old)
 {
-    while (rel_assign != rel_assign_save)
-        rel_assign = rel_assign->next;
+    if (trail_len == trail_alloc)
+    {
+        trail_alloc = trail_alloc == 0 ? 256 : 2*trail_alloc;
+        trail = (type_trail_t *) GC_REALLOC(trail, trail_alloc*sizeof(type_trail_t));
+    }
+
+    trail[trail_len].var = var;
+    trail[trail_len].old = old;
+    trail_len++;
 }
 
 void push_type_rel(type_t * t1, type_t * t2)
 {
-   type_rel_t * t = (type_rel_t *) GC_MALLOC(sizeof(type_rel_t));
+   type_rel_t * t = (type_rel_t *) arena_alloc(sizeof(type_rel_t));
    t->t1 = t1;
    t->t2 = t2;
    t->next = rel_stack;
@@ -59,149 +88,181 @@ type_rel_t * pop_type_rel(void)
    return t;
 }
 
-void type_subst_type(type_t ** tin, type_rel_t * rel)
+/* 
+   Return the type a typevar stands for, or the typevar itself if 
+   it is still unbound. Typevars passed on the way are pointed 
+   straight at the result so the next find is quicker.
+*/
+type_t * type_find(type_t * t)
+{
+    type_t * root = t, * next;
+
+    while (root->typ == TYPEVAR && root->bound != NULL)
+        root = root->bound;
+
+    while (t != root && t->bound != root)
+    {
+        next = t->bound;
+        trail_push(t, next);
+        t->bound = root;
+        t = next;
+    }
+
+    return root;
+}
+
+void type_bind(type_t * var, type_t * t)
+{
+    trail_push(var, NULL);
+    var->bound = t;
+}
+
+/* replace bound typevars anywhere in a type, in place */
+void type_resolve(type_t ** tin)
 {
-    type_t * t = *tin;
+    type_t * t = type_find(*tin);
     int i;
 
-    if (t == NULL)
-        return;
+    *tin = t;
     
-    if (t->typ == TYPEVAR)
-    {
-        if (*tin == rel->t1)
-            *tin = rel->t2;
-    }
-    else if (t->typ == FN || t->typ == LAMBDA)
+    if (t->canon)
+        return;
+
+    if (t->typ == FN || t->typ == LAMBDA)
     {
         for (i = 0; i < t->arity; i++)
-            type_subst_type(t->param + i, rel);
+            type_resolve(t->param + i);
         if (t->ret != NULL)
-            type_subst_type(&(t->ret), rel);
+            type_resolve(&(t->ret));
     } else if (t->typ == TUPLE || t->typ == DATATYPE)
     {
         for (i = 0; i < t->arity; i++)
-            type_subst_type(t->param + i, rel);
+            type_resolve(t->param + i);
     } else if (t->typ == ARRAY)
     {
-        type_subst_type(&(t->ret), rel);
+        type_resolve(&(t->ret));
     }
 }
 
 void subst_type(type_t ** tin)
 {
-    type_rel_t * rel = rel_assign;
+    type_t * t;
    
-    while (rel != NULL)
-    {
-        type_subst_type(tin, rel);
-        rel = rel->next;
-    }
-}
+    if (*tin == NULL)
+        return;
 
-void rels_subst(type_rel_t * rels, type_rel_t * rel)
-{
-    while (rels != NULL)
-    {
-        type_subst_type(&(rels->t1), rel);
-        type_subst_type(&(rels->t2), rel);
-        rels = rels->next;
-    }
-}
+    type_resolve(tin);
 
-void ass_subst(type_rel_t * rels, type_rel_t * rel)
-{
-    while (rels != NULL)
-    {
-        type_subst_type(&(rels->t2), rel);
-        rels = rels->next;
-    }
+    /* use the canonical instance once the type is known */
+    if ((t = type_canon(*tin)) != NULL)
+        *tin = t;
 }
 
-void unify(type_rel_t * rels, type_rel_t * ass)
+void unify(void)
 {
+    type_t * t1, * t2;
     int i, j;
     
     while (rel_stack != NULL)
     {
         type_rel_t * rel = pop_type_rel();
-        if (rel->t1 == rel->t2)
+        t1 = type_find(rel->t1);
+        t2 = type_find(rel->t2);
+        if (t1 == t2)
             continue;
-        else if (rel->t1->typ == TYPEVAR)
-        {
-            rels_subst(rel_stack, rel);
-            ass_subst(rel_assign, rel);
-            rel->next = rel_assign;
-            rel_assign = rel;
-        } else if (rel->t2->typ == TYPEVAR)
-            push_type_rel(rel->t2, rel->t1);
-        else if (rel->t1->typ == FN || rel->t1->typ == LAMBDA)
+        else if (t1->typ == TYPEVAR)
+            type_bind(t1, t2);
+        else if (t2->typ == TYPEVAR)
+            type_bind(t2, t1);
+        else if (t1->typ == FN || t1->typ == LAMBDA)
         {
-            if ((rel->t2->typ != FN && rel->t2->typ != LAMBDA) || rel->t1->arity != rel->t2->arity)
+            if ((t2->typ != FN && t2->typ != LAMBDA) || t1->arity != t2->arity)
                 exception("Type mismatch: function type not matched!\n");
-            push_type_rel(rel->t1->ret, rel->t2->ret);
-            for (i = 0; i < rel->t1->arity; i++)
-                push_type_rel(rel->t1->param[i], rel->t2->param[i]);
+            push_type_rel(t1->ret, t2->ret);
+            for (i = 0; i < t1->arity; i++)
+                push_type_rel(t1->param[i], t2->param[i]);
         }
-        else if (rel->t1->typ == TUPLE)
+        else if (t1->typ == TUPLE)
         {
-            if (rel->t2->typ != TUPLE || rel->t1->arity != rel->t2->arity)
+            if (t2->typ != TUPLE || t1->arity != t2->arity)
                 exception("Type mismatch: tuple type not matched!\n");
-            for (i = 0; i < rel->t1->arity; i++)
-                push_type_rel(rel->t1->param[i], rel->t2->param[i]);
+            for (i = 0; i < t1->arity; i++)
+                push_type_rel(t1->param[i], t2->param[i]);
         }
-        else if (rel->t1->typ == ARRAY)
+        else if (t1->typ == ARRAY)
         {
-            if (rel->t2->typ != ARRAY)
+            if (t2->typ != ARRAY)
                 exception("Type mismatch: array type not matched!\n");
-            push_type_rel(rel->t1->ret, rel->t2->ret);
+            push_type_rel(t1->ret, t2->ret);
         }
-        else if (rel->t1->typ == DATATYPE)
+        else if (t1->typ == DATATYPE)
         {
-            if (rel->t2->typ != DATATYPE)
+            if (t2->typ != DATATYPE)
                 exception("Type mismatch: data type not matched!\n");
-            if (rel->t1->sym != NULL && rel->t2->sym != NULL) /* comparing two full datatypes */
+            if (t1->sym != NULL && t2->sym != NULL) /* comparing two full datatypes */
             {
-                if (rel->t1->arity != rel->t2->arity || rel->t1->sym != rel->t2->sym)
+                if (t1->arity != t2->arity || t1->sym != t2->sym)
                     exception("Type mismatch: data type not matched!\n");
-                for (i = 0; i < rel->t1->arity; i++)
-                    push_type_rel(rel->t1->param[i], rel->t2->param[i]);
+                for (i = 0; i < t1->arity; i++)
+                    push_type_rel(t1->param[i], t2->param[i]);
             } else /* one of the data types is not full */
             {
-                if (rel->t1->sym == NULL) /* switch order */
-                    push_type_rel(rel->t2, rel->t1);
+                if (t1->sym == NULL) /* switch order */
+                    push_type_rel(t2, t1);
                 else /* compare partial datatype with full */
                 {
-                    for (i = 0; i < rel->t1->arity; i++)
-                        if (rel->t1->slot[i] == rel->t2->slot[0])
+                    for (i = 0; i < t1->arity; i++)
+                        if (t1->slot[i] == t2->slot[0])
                             break;
-                    if (i == rel->t1->arity) /* slot was not found */
+                    if (i == t1->arity) /* slot was not found */
                         exception("Nonexistent slot!\n");
                     /* check type of slot is right */
-                    push_type_rel(rel->t1->param[i], rel->t2->param[0]);
+                    push_type_rel(t1->param[i], t2->param[0]);
 
                     /* update partial type */
-                    type_t * t = rel->t2->param[0];
-                    rel->t2->param = (type_t **) GC_MALLOC(rel->t1->arity*sizeof(type_t *));
-                    rel->t2->slot = (sym_t **) GC_MALLOC(rel->t1->arity*sizeof(sym_t *));
-                    for (j = 0; j < rel->t1->arity; j++)
+                    type_t * t = t2->param[0];
+                    t2->param = (type_t **) GC_MALLOC(t1->arity*sizeof(type_t *));
+                    t2->slot = (sym_t **) GC_MALLOC(t1->arity*sizeof(sym_t *));
+                    for (j = 0; j < t1->arity; j++)
                     {
-                        rel->t2->param[j] = rel->t1->param[j]; 
-                        rel->t2->slot[j] = rel->t1->slot[j]; 
+                        t2->param[j] = t1->param[j]; 
+                        t2->slot[j] = t1->slot[j]; 
                     }
-                    rel->t2->sym = rel->t1->sym;
-                    rel->t2->arity = rel->t1->arity;
+                    t2->sym = t1->sym;
+                    t2->arity = t1->arity;
 
                     /* restore partial type for slot */
-                    rel->t2->param[i] = t; 
+                    t2->param[i] = t; 
                 }
             }
         }
-        else if (rel->t1->typ != rel->t2->typ)
+        else if (t1->typ != t2->typ)
            exception("Type mismatch!\n");
     }
 }
 
+/* 
+   Note a use of a binding. A global used inside a function or lambda
+   is referred to by its compiled body for good, so it must be kept 
+   even once a newer binding hides it
+*/
+void bind_use(bind_t * b)
+{
+    if (b->depth == 0 && fn_depth > 0)
+        b->used = 1;
+}
+
+/*
+   Note a use of a global function as a value rather than in a call.
+   The value may be stored and called after the statement has run, so
+   the function must be kept
+*/
+void bind_use_value(bind_t * b)
+{
+    if (b->depth == 0 && b->ast != NULL)
+        b->used = 1;
+}
+
 /* bind a new identifier in the symbol table */
 bind_t * bind_id(ast_t * id)
 {
@@ -223,7 +284,7 @@ bind_t * bind_tuple(ast_t * id)
     int count = ast_list_length(p);
     int i;
 
-    type_t ** param = (type_t **) GC_MALLOC(count*sizeof(type_t *));
+    type_t ** param = (type_t **) arena_alloc(count*sizeof(type_t *));
     for (i = 0; i < count; i++)
     {
         if (p->tag == AST_LTUPLE) /* we have a tuple */
@@ -251,6 +312,12 @@ bind_t * bind_tuple(ast_t * id)
    3) Add a type to the ast node corresponding to either the known type of the
       node or the generated type variable for the node
    4) Bind symbols and set ast->bind to the correct binding
+
+   Unlike the walkers in backend.c this recurses, as each case does
+   its work after its children. Statement lists are looped over, so
+   only nesting costs stack, at 96 bytes a level. The parser runs out
+   first: with a 1MB stack it overflows on parentheses 4000 deep,
+   which would take under 400kB here.
 */
 void annotate_ast(ast_t * a)
 {
@@ -270,7 +337,9 @@ void annotate_ast(ast_t * a)
         if (b != NULL && b->initialised) /* ensure initialised and exists */
         {
             a->type = b->type;
-            a->bind = b; /* make sure we use the right binding */
+            AST_BIND(a) = b; /* make sure we use the right binding */
+            bind_use(b);
+            bind_use_value(b);
         } else
         {
            printf("%s ", a->sym->name);
@@ -282,8 +351,9 @@ void annotate_ast(ast_t * a)
         if (b != NULL) /* ensure it exists */
         {
             a->type = b->type;
-            a->bind = b; /* make sure we use the right binding */
+            AST_BIND(a) = b; /* make sure we use the right binding */
             b->initialised = 1; 
+            bind_use(b);
         } else
         {
            printf("%s ", a->sym->name);
@@ -293,7 +363,7 @@ void annotate_ast(ast_t * a)
     case AST_LTUPLE:
         p = a->child;
         count = ast_list_length(p); /* count parameters */
-        param = (type_t **) GC_MALLOC(count*sizeof(type_t *));
+        param = (type_t **) arena_alloc(count*sizeof(type_t *));
         for (i = 0; i < count; i++)
         {
            annotate_ast(p);
@@ -402,7 +472,7 @@ void annotate_ast(ast_t * a)
             } else
             {
                 bind->initialised = 0;
-                p->bind = bind;
+                AST_BIND(p) = bind;
             }
  
             p = p->next;
@@ -433,7 +503,7 @@ void annotate_ast(ast_t * a)
         break;
     case AST_BLOCK:
         t = a->child;
-        current_scope = a->env;
+        scope_enter(AST_ENV(a));
         while (t != NULL)
         {
             annotate_ast(t);
@@ -466,10 +536,10 @@ void annotate_ast(ast_t * a)
         p = id->next->child; 
         count = ast_list_length(p); /* count parameters */
         
-        current_scope = a->env;
+        scope_enter(AST_ENV(a));
         
         /* add parameters into scope */
-        param = (type_t **) GC_MALLOC(count*sizeof(type_t *));
+        param = (type_t **) arena_alloc(count*sizeof(type_t *));
         for (i = 0; i < count; i++)
         {
            param[i] = p->type = new_typevar(); /* set types */
@@ -497,9 +567,10 @@ void annotate_ast(ast_t * a)
         bind = bind_lambda(id->sym, id->type, a);
         bind->initialised = 1;
 
-        current_scope = a->env;
+        scope_enter(AST_ENV(a));
         
         /* process function body */
+        fn_depth++;
         expr = id->next->next;
         expr->type = t_nil;
         expr = expr->child;
@@ -508,6 +579,7 @@ void annotate_ast(ast_t * a)
             annotate_ast(expr);
             expr = expr->next;
         }
+        fn_depth--;
         
         scope_down();
 
@@ -517,10 +589,10 @@ void annotate_ast(ast_t * a)
         p = a->child->child; 
         count = ast_list_length(p); /* count parameters */
         
-        current_scope = a->env;
+        scope_enter(AST_ENV(a));
         
         /* add parameters into scope */
-        param = (type_t **) GC_MALLOC(count*sizeof(type_t *));
+        param = (type_t **) arena_alloc(count*sizeof(type_t *));
         for (i = 0; i < count; i++)
         {
            param[i] = p->type = new_typevar(); /* set types */
@@ -544,15 +616,15 @@ void annotate_ast(ast_t * a)
         scope_down();
         
         /* Add function to global scope */
-        a->type = fn_type(retty, count, param);
-        a->type->typ = LAMBDA;
+        a->type = closure_type(retty, count, param);
         sym = sym_lookup("lambda");
         b = bind_lambda(sym, a->type, a);
         b->initialised = 1;
 
-        current_scope = a->env;
+        scope_enter(AST_ENV(a));
         
         /* process function body */
+        fn_depth++;
         t = a->child->next;
         if (t->tag == AST_EXPRBLOCK)
         {
@@ -568,6 +640,7 @@ void annotate_ast(ast_t * a)
             expr = t;
             annotate_ast(expr);
         }
+        fn_depth--;
         t->type = expr->type;
         push_type_rel(bind->type, t->type);
         
@@ -583,7 +656,8 @@ void annotate_ast(ast_t * a)
             if (bind != NULL)
             {
                 id->type = bind->type;
-                id->bind = bind;
+                AST_BIND(id) = bind;
+                bind_use(bind);
             } else
                 exception("Unknown function or datatype\n");
         } else /* we may not have an identifier giving the function */
@@ -597,11 +671,10 @@ void annotate_ast(ast_t * a)
         if (id->type->typ != FN && id->type->typ != LAMBDA && id->type->typ != DATATYPE) 
         {
             /* build appropriate function type */
-            param = (type_t **) GC_MALLOC(count*sizeof(type_t *));
+            param = (type_t **) arena_alloc(count*sizeof(type_t *));
             for (i = 0; i < count; i++)
                 param[i] = new_typevar();
-            type_t * fn_ty = fn_type(new_typevar(), count, param);
-            fn_ty->typ = LAMBDA;
+            type_t * fn_ty = closure_type(new_typevar(), count, param);
 
             /* use it instead and infer the typevar */
             push_type_rel(id->type, fn_ty);
@@ -637,7 +710,7 @@ void annotate_ast(ast_t * a)
         count = ast_list_length(p);
         
         /* build appropriate tuple type */
-        param = (type_t **) GC_MALLOC(count*sizeof(type_t *));
+        param = (type_t **) arena_alloc(count*sizeof(type_t *));
         
         /* get parameter types */
         for (i = 0; i < count; i++)
@@ -658,11 +731,11 @@ void annotate_ast(ast_t * a)
         p = id->next;
         count = ast_list_length(p);
         
-        current_scope = a->env;
+        scope_enter(AST_ENV(a));
         
         /* build appropriate data type */
-        param = (type_t **) GC_MALLOC(count*sizeof(type_t *));
-        slot = (sym_t **) GC_MALLOC(count*sizeof(sym_t *));
+        param = (type_t **) arena_alloc(count*sizeof(type_t *));
+        slot = (sym_t **) arena_alloc(count*sizeof(sym_t *));
         
         /* get parameter types */
         for (i = 0; i < count; i++)
@@ -686,8 +759,8 @@ void annotate_ast(ast_t * a)
             a->type = new_typevar();
 
         /* make data type */
-        param = (type_t **) GC_MALLOC(sizeof(type_t *));
-        slot = (sym_t **) GC_MALLOC(sizeof(sym_t *));
+        param = (type_t **) arena_alloc(sizeof(type_t *));
+        slot = (sym_t **) arena_alloc(sizeof(sym_t *));
         param[0] = a->type;
         slot[0] = p->sym;
         ty = data_type(1, param, NULL, slot);
@@ -743,14 +816,18 @@ void annotate_ast(ast_t * a)
     }
 }
 
-void print_assigns(type_rel_t * ass)
+/* print the bindings made by the current statement */
+void print_assigns(void)
 {
-    while (ass != NULL)
+    int i;
+
+    for (i = 0; i < trail_len; i++)
     {
-        print_type(ass->t1);
+        if (trail[i].old != NULL) /* shortened path, not a new binding */
+            continue;
+        print_type(trail[i].var);
         printf(" = ");
-        print_type(ass->t2);
+        print_type(trail[i].var->bound);
         printf(";\n");
-        ass = ass->next;
     }
 }
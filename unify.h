@@ -15,28 +15,36 @@ typedef struct type_rel_t
    struct type_rel_t * next;
 } type_rel_t;
 
+/* a change unify made to a typevar, so that it can be undone */
+typedef struct type_trail_t
+{
+   type_t * var;
+   type_t * old; /* what var was bound to before */
+} type_trail_t;
+
 extern type_rel_t * rel_stack;
-extern type_rel_t * rel_assign;
 
 void rel_stack_init(void);
 
-void rel_assign_init(void);
+void trail_init(void);
 
-void rel_assign_mark(void);
+void trail_commit(void);
 
-void rel_assign_rewind(void);
+void trail_rewind(void);
 
 void push_type_rel(type_t * t1, type_t * t2);
 
 type_rel_t * pop_type_rel(void);
 
+type_t * type_find(type_t * t);
+
 void subst_type(type_t ** type);
 
-void unify(type_rel_t * rels, type_rel_t * ass);
+void unify(void);
 
 void annotate_ast(ast_t * a);
 
-void print_assigns(type_rel_t * ass);
+void print_assigns(void);
 
 #ifdef __cplusplus
 }